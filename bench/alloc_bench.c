@@ -0,0 +1,117 @@
+// Cost and allocations of the hot paths of a command: parsing and freeing a
+// command line, resolving a name in PATH and a filesearch of a small tree.
+// `make bench` builds it twice, without and with -DSHELLFYRE_ALLOC_PROFILE,
+// so the two runs give the overhead of the profiling wrappers. The profiling
+// build also prints the allocations of every operation and fails if one of
+// them leaves memory behind, or if a failed realloc changes the counts.
+//
+// Usage: alloc_bench [operations]
+
+#define main shellfyre_main
+#include "../shellfyre.c"
+#undef main
+
+#include <math.h>
+
+#define TREE_FILES 2000
+
+static const char *lines[] = {"ls -la /tmp", "git commit -m \"fix\"", "filesearch -r main", "cd ..", "make -j8 > log"};
+static char tree[64];
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void parse(long i) {
+    char buf[256];
+    struct command_t *command = calloc(1, sizeof(struct command_t));
+
+    strcpy(buf, lines[i % 5]);
+    parse_command(buf, command);
+    free_command(command);
+}
+
+static void resolve(long i) {
+    free(find_path(i % 2 ? "ls" : "sh"));
+}
+
+static void search(long i) {
+    char buf[] = "filesearch -r needle";
+    struct command_t *command = calloc(1, sizeof(struct command_t));
+
+    parse_command(buf, command);
+    process_command(command);
+    free_command(command);
+}
+
+// Best of five rounds, in nanoseconds per operation.
+static bool run(const char *name, void (*operation)(long), long count) {
+    double best = 1e18;
+
+#ifdef SHELLFYRE_ALLOC_PROFILE
+    unsigned long allocations = alloc_profile.allocations;
+    size_t live = alloc_profile.live;
+#endif
+    for (int round = 0; round < 5; round++) {
+        double start = now_ns();
+        for (long i = 0; i < count; i++)
+            operation(i);
+        best = fmin(best, (now_ns() - start) / count);
+    }
+
+#ifdef SHELLFYRE_ALLOC_PROFILE
+    double per_operation = (double) (alloc_profile.allocations - allocations) / (5 * count);
+    long retained = (long) alloc_profile.live - (long) live;
+    fprintf(stderr, "%-12s %12.1f ns  %6.1f allocations  %6ld bytes retained  (profiled)\n", name, best, per_operation, retained);
+    return retained == 0;
+#else
+    fprintf(stderr, "%-12s %12.1f ns\n", name, best);
+    return true;
+#endif
+}
+
+int main(int argc, char *argv[]) {
+    long count = argc > 1 ? atol(argv[1]) : 200000;
+    char path[128];
+
+    snprintf(tree, sizeof(tree), "/tmp/shellfyre_alloc_bench_%d", getpid());
+    mkdir(tree, 0700);
+    for (int i = 0; i < TREE_FILES; i++) {
+        snprintf(path, sizeof(path), "%s/%s%d", tree, i % 100 ? "file" : "needle", i);
+        close(open(path, O_WRONLY | O_CREAT, 0600));
+    }
+
+    // filesearch prints its matches, they go to /dev/null.
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    chdir(tree);
+    history_load(); // the history is loaded once, not by the first command
+    dircache_load();
+    dircache.limit = 0; // every search reads the directory
+
+    bool ok = run("parse", parse, count);
+    ok = run("find_path", resolve, count / 10) && ok;
+    ok = run("filesearch", search, count / 1000) && ok;
+
+#ifdef SHELLFYRE_ALLOC_PROFILE
+    // A failed realloc leaves the block and the counts as they were.
+    volatile size_t huge = SIZE_MAX / 2;
+    char *block = malloc(64);
+    unsigned long allocations = alloc_profile.allocations;
+    size_t live = alloc_profile.live;
+    bool failed = realloc(block, huge) == NULL;
+    bool same = alloc_profile.allocations == allocations && alloc_profile.live == live;
+    free(block);
+    fprintf(stderr, "%-12s %s\n", "failed realloc", failed && same ? "counts unchanged" : "COUNTED");
+    ok = failed && same && ok;
+#endif
+
+    for (int i = 0; i < TREE_FILES; i++) {
+        snprintf(path, sizeof(path), "%s/%s%d", tree, i % 100 ? "file" : "needle", i);
+        unlink(path);
+    }
+    rmdir(tree);
+    return ok ? 0 : 1;
+}
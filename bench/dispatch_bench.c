@@ -0,0 +1,72 @@
+// Cost of finding a builtin by name: the hashed table against the strcmp chain
+// process_command() used before.
+//
+// Usage: dispatch_bench [lookups]
+
+#define main shellfyre_main
+#include "../shellfyre.c"
+#undef main
+
+#include <time.h>
+
+static const char *hits[] = {"exit", "cd", "filesearch", "cdh", "take", "joker", "todo", "pstraverse"};
+static const char *misses[] = {"ls", "grep", "make", "vim", "cat", "git", "tar", "python3"};
+
+// The dispatch of the old process_command().
+static int strcmp_chain(const char *name) {
+    if (strcmp(name, "exit") == 0) return 1;
+    if (strcmp(name, "cd") == 0) return 2;
+    if (strcmp(name, "filesearch") == 0) return 3;
+    if (strcmp(name, "cdh") == 0) return 4;
+    if (strcmp(name, "take") == 0) return 5;
+    if (strcmp(name, "joker") == 0) return 6;
+    if (strcmp(name, "todo") == 0) return 7;
+    if (strcmp(name, "pstraverse") == 0) return 8;
+    return 0;
+}
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void run(const char *name, const char **names, long lookups) {
+    volatile long found = 0;
+    int count = 8;
+
+    double start = now_ns();
+    for (long i = 0; i < lookups; i++)
+        found += find_builtin(names[i % count]) != NULL;
+    double hashed = (now_ns() - start) / lookups;
+
+    start = now_ns();
+    for (long i = 0; i < lookups; i++)
+        found += strcmp_chain(names[i % count]) != 0;
+    double chain = (now_ns() - start) / lookups;
+
+    printf("%-6s %ld lookups  hashed %6.2f ns  strcmp chain %6.2f ns\n", name, lookups, hashed, chain);
+}
+
+int main(int argc, char *argv[]) {
+    long lookups = argc > 1 ? atol(argv[1]) : 10000000;
+
+    // Every builtin has to be found under its own name, which also catches a
+    // BUILTIN() entry whose first or last character does not match the name.
+    for (int i = 0; i < BUILTIN_TABLE_SIZE; i++) {
+        if (builtins[i].name && find_builtin(builtins[i].name) != &builtins[i]) {
+            printf("builtin %s is not found\n", builtins[i].name);
+            return 1;
+        }
+    }
+    for (int i = 0; i < 8; i++) {
+        if (find_builtin(misses[i]) != NULL) {
+            printf("%s is found as a builtin\n", misses[i]);
+            return 1;
+        }
+    }
+
+    run("hits", hits, lookups);
+    run("misses", misses, lookups);
+    return 0;
+}
@@ -0,0 +1,342 @@
+// End-to-end benchmark of the interactive shell. The shell binary runs under a
+// pseudo-terminal and scripted sessions are typed into it, the way a user
+// would: keystroke-to-echo latency, prompt-to-prompt time of a builtin and of
+// an external command, output throughput of a command, filesearch over a
+// generated tree and cdh with a large history. No root and no kernel module
+// are needed.
+//
+// The results are written as JSON and compared with a baseline in the same
+// format. Without a baseline, the results become the baseline.
+//
+// Usage: e2e_bench [shell] [results] [baseline]
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pty.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PROMPT "shellfyre$ "
+#define SAMPLES 200
+#define OUTPUT_MB 8
+#define TREE_FILES 20000
+#define HISTORY_LINES 100000
+#define TIMEOUT_MS 10000
+#define REGRESSION 1.25 // worse than the baseline by this factor is reported
+
+struct metric {
+    char name[64];
+    double value;
+    bool higher_is_better;
+};
+
+static struct metric metrics[32];
+static int metric_count;
+
+static int master = -1;
+static pid_t shell;
+static char screen[1 << 16]; // output of the shell not matched yet
+static size_t screen_len;
+static size_t bytes_read;
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static void add_metric(const char *name, double value, bool higher_is_better) {
+    snprintf(metrics[metric_count].name, sizeof(metrics[metric_count].name), "%s", name);
+    metrics[metric_count].value = value;
+    metrics[metric_count++].higher_is_better = higher_is_better;
+}
+
+// Adds the median and the 99th percentile of the samples.
+static void add_percentiles(const char *name, double *samples, int n) {
+    char metric[64];
+
+    qsort(samples, n, sizeof(double), compare_double);
+    snprintf(metric, sizeof(metric), "%s_p50_us", name);
+    add_metric(metric, samples[n / 2], false);
+    snprintf(metric, sizeof(metric), "%s_p99_us", name);
+    add_metric(metric, samples[n * 99 / 100], false);
+    printf("%-16s p50 %10.1f us  p99 %10.1f us\n", name, samples[n / 2], samples[n * 99 / 100]);
+}
+
+static bool type(const char *text) {
+    size_t len = strlen(text);
+    return write(master, text, len) == (ssize_t) len;
+}
+
+// Reads the terminal until the text shows up and drops the output up to it.
+static bool wait_for(const char *text) {
+    size_t len = strlen(text);
+
+    while (1) {
+        char *found = memmem(screen, screen_len, text, len);
+        if (found) {
+            screen_len -= found + len - screen;
+            memmove(screen, found + len, screen_len);
+            return true;
+        }
+        if (screen_len >= len) { // only the end can still be a part of the text
+            memmove(screen, screen + screen_len - (len - 1), len - 1);
+            screen_len = len - 1;
+        }
+
+        struct pollfd pfd = {.fd = master, .events = POLLIN};
+        if (poll(&pfd, 1, TIMEOUT_MS) <= 0)
+            return false;
+        ssize_t n = read(master, screen + screen_len, sizeof(screen) - screen_len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        screen_len += n;
+        bytes_read += n;
+    }
+}
+
+// Runs a command line and returns the time to the next prompt, or -1.
+static double run(const char *line) {
+    double start = now_us();
+    if (!type(line) || !type("\n") || !wait_for(PROMPT))
+        return -1;
+    return now_us() - start;
+}
+
+static bool start_shell(const char *path, const char *directory) {
+    struct winsize size = {.ws_row = 50, .ws_col = 200};
+
+    shell = forkpty(&master, NULL, NULL, &size);
+    if (shell == 0) {
+        if (chdir(directory) != 0)
+            exit(126);
+        execl(path, path, NULL);
+        exit(127);
+    }
+    return shell > 0 && wait_for(PROMPT);
+}
+
+static void stop_shell() {
+    type("exit\n");
+    close(master);
+    waitpid(shell, NULL, 0);
+}
+
+static bool bench_echo() {
+    double samples[SAMPLES];
+
+    // Type a line and erase it again, one key at a time.
+    for (int i = 0; i < SAMPLES; i++) {
+        bool erase = i % 20 >= 10;
+        double start = now_us();
+        if (!type(erase ? "\177" : "a") || !wait_for(erase ? "\b \b" : "a"))
+            return false;
+        samples[i] = now_us() - start;
+    }
+    add_percentiles("echo", samples, SAMPLES);
+    return true;
+}
+
+static bool bench_command(const char *name, const char *line) {
+    double samples[SAMPLES];
+
+    for (int i = 0; i < SAMPLES; i++)
+        if ((samples[i] = run(line)) < 0)
+            return false;
+    add_percentiles(name, samples, SAMPLES);
+    return true;
+}
+
+static bool bench_output(const char *directory) {
+    char path[PATH_MAX], line[PATH_MAX + 8];
+    char text[4096];
+
+    // Lines of 64 bytes, like a build log.
+    for (size_t i = 0; i < sizeof(text); i += 64) {
+        memset(text + i, 'x', 63);
+        text[i + 63] = '\n';
+    }
+    snprintf(path, sizeof(path), "%s/output", directory);
+    FILE *file = fopen(path, "w");
+    if (!file)
+        return false;
+    for (int i = 0; i < OUTPUT_MB * 256; i++)
+        fwrite(text, 1, sizeof(text), file);
+    fclose(file);
+
+    double best = 1e18;
+    snprintf(line, sizeof(line), "cat %s", path);
+    for (int i = 0; i < 5; i++) {
+        size_t before = bytes_read;
+        double us = run(line);
+        if (us < 0 || bytes_read - before < (size_t) OUTPUT_MB << 20)
+            return false;
+        best = us < best ? us : best;
+    }
+    add_metric("output_mb_per_s", OUTPUT_MB / (best / 1e6), true);
+    printf("%-16s %10.1f MB/s\n", "output", OUTPUT_MB / (best / 1e6));
+    return true;
+}
+
+// root/dNN/fileNNNNN, with one file in a thousand named needle.
+static bool make_tree(const char *root) {
+    char path[PATH_MAX + 32];
+
+    mkdir(root, 0700);
+    for (int i = 0; i < TREE_FILES; i++) {
+        snprintf(path, sizeof(path), "%s/d%02d", root, i / 1000);
+        mkdir(path, 0700);
+        snprintf(path, sizeof(path), "%s/d%02d/%s%05d", root, i / 1000, i % 1000 ? "file" : "needle", i);
+        int fd = open(path, O_WRONLY | O_CREAT, 0600);
+        if (fd < 0)
+            return false;
+        close(fd);
+    }
+    return true;
+}
+
+static bool bench_filesearch(const char *directory) {
+    char root[PATH_MAX], line[PATH_MAX + 8];
+    double samples[20];
+
+    snprintf(root, sizeof(root), "%s/tree", directory);
+    if (!make_tree(root))
+        return false;
+    sleep(1); // directories changed within the last second are not cached
+
+    snprintf(line, sizeof(line), "cd %s", root);
+    double first = run(line) < 0 ? -1 : run("filesearch -r needle");
+    for (int i = 0; i < 20; i++)
+        if ((samples[i] = run("filesearch -r needle")) < 0)
+            return false;
+    if (first < 0 || run("cd ..") < 0)
+        return false;
+
+    add_metric("filesearch_first_us", first, false);
+    printf("%-16s first %8.1f us\n", "filesearch", first);
+    add_percentiles("filesearch", samples, 20);
+    return true;
+}
+
+static bool bench_cdh() {
+    double samples[50];
+
+    for (int i = 0; i < 50; i++) {
+        double start = now_us();
+        if (!type("cdh\n") || !wait_for("Select directory by letter or number: ")
+            || !type(i % 2 ? "1\n" : "2\n") || !wait_for(PROMPT))
+            return false;
+        samples[i] = now_us() - start;
+    }
+    add_percentiles("cdh", samples, 50);
+    return true;
+}
+
+// Writes the directories cdh offers, alternating between two of them.
+static bool make_history(const char *directory) {
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/cdh_history.txt", directory);
+    FILE *file = fopen(path, "w");
+    if (!file)
+        return false;
+    for (int i = 0; i < HISTORY_LINES; i++)
+        fprintf(file, "%s%s\n", directory, i % 2 ? "/tree" : "");
+    fclose(file);
+    return true;
+}
+
+static void write_results(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        printf("cannot write %s: %s\n", path, strerror(errno));
+        return;
+    }
+    fprintf(file, "{\n");
+    for (int i = 0; i < metric_count; i++)
+        fprintf(file, "  \"%s\": %.3f%s\n", metrics[i].name, metrics[i].value, i + 1 < metric_count ? "," : "");
+    fprintf(file, "}\n");
+    fclose(file);
+}
+
+// Compares with a baseline written by write_results().
+static void compare(const char *path) {
+    FILE *file = fopen(path, "r");
+    char line[256], name[64];
+    double value;
+    int regressions = 0;
+
+    printf("\n%-24s %12s %12s %8s\n", "metric", "baseline", "now", "change");
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, " \"%63[^\"]\": %lf", name, &value) != 2)
+            continue;
+        for (int i = 0; i < metric_count; i++) {
+            if (strcmp(metrics[i].name, name) != 0)
+                continue;
+            double worse = metrics[i].higher_is_better ? value / metrics[i].value : metrics[i].value / value;
+            bool regression = worse > REGRESSION;
+            regressions += regression;
+            printf("%-24s %12.1f %12.1f %+7.1f%%%s\n", name, value, metrics[i].value,
+                   (metrics[i].value - value) * 100 / value, regression ? "  REGRESSION" : "");
+        }
+    }
+    fclose(file);
+    printf("%d regressions against %s\n", regressions, path);
+}
+
+int main(int argc, char *argv[]) {
+    char shell_path[PATH_MAX], directory[] = "/tmp/shellfyre_e2e_XXXXXX";
+    const char *results = argc > 2 ? argv[2] : "e2e_results.json";
+    const char *baseline = argc > 3 ? argv[3] : NULL;
+
+    if (!realpath(argc > 1 ? argv[1] : "./main", shell_path) || !mkdtemp(directory)) {
+        printf("usage: e2e_bench [shell] [results] [baseline]\n");
+        return 1;
+    }
+
+    bool ok = make_history(directory) && start_shell(shell_path, directory);
+    ok = ok && bench_echo();
+    ok = ok && bench_command("builtin", "cd .");
+    ok = ok && bench_command("external", "true");
+    ok = ok && bench_output(directory);
+    ok = ok && bench_filesearch(directory);
+    ok = ok && bench_cdh();
+    if (shell > 0)
+        stop_shell();
+
+    char command[PATH_MAX + 16];
+    snprintf(command, sizeof(command), "rm -rf %s", directory);
+    if (system(command) != 0)
+        printf("cannot remove %s\n", directory);
+
+    if (!ok) {
+        printf("the session did not get the expected output, last seen: %.*s\n", (int) screen_len, screen);
+        return 1;
+    }
+
+    write_results(results);
+    if (baseline && access(baseline, R_OK) == 0) {
+        compare(baseline);
+    } else if (baseline) {
+        write_results(baseline);
+        printf("no baseline yet, this run is now %s\n", baseline);
+    }
+    return 0;
+}
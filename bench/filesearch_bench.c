@@ -0,0 +1,202 @@
+// Recursive filesearch on a tree of files with the synchronous walker and the
+// io_uring backend at several queue depths. Every walk starts from a cold cache
+// if the page, dentry and inode caches can be dropped (which needs root),
+// otherwise the walks are warm and say so. Then repeated warm searches with
+// the directory listing cache of search_file() against the walker without it,
+// and checks of what the cache keeps.
+//
+// The tree is created in /tmp, or in the given directory, and kept for the
+// next run. `make bench` walks 10^5 files, `make filesearch-bench` walks 10^6
+// from a cold cache as root; the tree of 10^6 takes about 15 s to create.
+//
+// Usage: filesearch_bench [files] [directory]
+
+#define main shellfyre_main
+#include "../shellfyre.c"
+#undef main
+
+#include <time.h>
+#include <math.h>
+
+#define FILES_PER_DIR 1000
+#define NEEDLES 100
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Creates root/dNNN/dNNN/fileNNN, with NEEDLES of the files named needle.
+static void make_tree(const char *root, int files) {
+    char path[512];
+    int dirs = (files + FILES_PER_DIR - 1) / FILES_PER_DIR;
+
+    mkdir(root, 0700);
+    for (int d = 0; d < dirs; d++) {
+        snprintf(path, sizeof(path), "%s/d%03d", root, d / 32);
+        mkdir(path, 0700);
+        snprintf(path, sizeof(path), "%s/d%03d/d%03d", root, d / 32, d % 32);
+        mkdir(path, 0700);
+
+        for (int f = 0; f < FILES_PER_DIR && d * FILES_PER_DIR + f < files; f++) {
+            int n = d * FILES_PER_DIR + f;
+            bool needle = n % (files / NEEDLES > 0 ? files / NEEDLES : 1) == 0;
+            snprintf(path, sizeof(path), "%s/d%03d/d%03d/%s%d", root, d / 32, d % 32, needle ? "needle" : "file", n);
+            close(open(path, O_WRONLY | O_CREAT, 0600));
+        }
+    }
+}
+
+static bool drop_caches() {
+    sync();
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    bool dropped = fd >= 0 && write(fd, "3", 1) == 1;
+    if (fd >= 0)
+        close(fd);
+    return dropped;
+}
+
+static int count_files(char *file_list[]) {
+    int count = 0;
+    while (count < FILE_LIST_SIZE && strcmp(file_list[count], "") != 0)
+        count++;
+    return count;
+}
+
+// search_file() before the directory listing cache.
+static void search_file_readdir(char *file, char *dir_name, char *file_list[]) {
+    DIR *dir = opendir(dir_name);
+    struct dirent *entry;
+
+    if (dir) {
+        while ((entry = readdir(dir)) != NULL) {
+            if (strstr(entry->d_name, file) && entry->d_type == DT_REG)
+                add_file(file_list, dir_name, entry->d_name);
+
+            if (entry->d_type == DT_DIR && strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+                char path[1024];
+                snprintf(path, sizeof(path), "%s/%s", dir_name, entry->d_name);
+                search_file_readdir(file, path, file_list);
+            }
+        }
+        closedir(dir);
+    }
+}
+
+// Best of five warm searches, with the listing cache or without.
+static int repeat(char *root, bool cached) {
+    char *file_list[FILE_LIST_SIZE];
+    double best = 1e9;
+    int matches = 0;
+
+    for (int run = 0; run < 5; run++) {
+        for (int i = 0; i < FILE_LIST_SIZE; i++)
+            file_list[i] = calloc(1, 1);
+
+        double start = now_ms();
+        if (cached)
+            search_file("needle", root, "r", file_list);
+        else
+            search_file_readdir("needle", root, file_list);
+        best = fmin(best, now_ms() - start);
+
+        matches = count_files(file_list);
+        for (int i = 0; i < FILE_LIST_SIZE; i++)
+            free(file_list[i]);
+    }
+
+    printf("%-12s %10.1f ms  %4d matches  warm, best of 5\n", cached ? "cached" : "readdir", best, matches);
+    return matches;
+}
+
+// Runs one walk and returns the number of matches.
+static int walk(char *root, int queue_depth, bool *cold) {
+    char *file_list[FILE_LIST_SIZE];
+    for (int i = 0; i < FILE_LIST_SIZE; i++)
+        file_list[i] = calloc(1, 1);
+
+    *cold = drop_caches();
+    double start = now_ms();
+    if (queue_depth == 0)
+        search_file("needle", root, "r", file_list);
+    else if (search_file_uring("needle", root, true, file_list, queue_depth) != 0)
+        printf("io_uring is not available, ");
+    double ms = now_ms() - start;
+
+    int matches = count_files(file_list);
+    for (int i = 0; i < FILE_LIST_SIZE; i++)
+        free(file_list[i]);
+
+    char name[32] = "sync";
+    if (queue_depth)
+        snprintf(name, sizeof(name), "uring q=%d", queue_depth);
+    printf("%-12s %10.1f ms  %4d matches  %s\n", name, ms, matches, *cold ? "cold" : "warm");
+    return matches;
+}
+
+// A directory changed just before a second boundary can still change within
+// the same mtime tick just after it, so its listing must not be kept then.
+static bool recent_change() {
+    char dir[64], path[96];
+    struct timespec now;
+
+    snprintf(dir, sizeof(dir), "/tmp/shellfyre_filesearch_recent_%d", getpid());
+    snprintf(path, sizeof(path), "%s/file", dir);
+    mkdir(dir, 0700);
+    do
+        clock_gettime(CLOCK_REALTIME, &now);
+    while (now.tv_nsec < 990000000);
+    close(open(path, O_WRONLY | O_CREAT, 0600));
+    usleep(20000);
+
+    unsigned long uncacheable = dircache.uncacheable;
+    dircache_put(dircache_get(dir));
+    bool kept = dircache.uncacheable == uncacheable;
+    unlink(path);
+    rmdir(dir);
+    printf("changed 10 ms before a second boundary: %s\n", kept ? "CACHED" : "not cached");
+    return !kept;
+}
+
+int main(int argc, char *argv[]) {
+    int files = argc > 1 ? atoi(argv[1]) : 1000000;
+    char root[256];
+    bool cold;
+
+    if (argc > 2) {
+        snprintf(root, sizeof(root), "%s", argv[2]);
+    } else {
+        snprintf(root, sizeof(root), "/tmp/shellfyre_filesearch_bench_%d", files);
+    }
+    if (access(root, F_OK) != 0) {
+        double start = now_ms();
+        make_tree(root, files);
+        printf("created %d files in %s in %.1f s\n", files, root, (now_ms() - start) / 1e3);
+    }
+
+    dircache.loaded = true; // the cold walks do not use the listing cache
+    int expected = walk(root, 0, &cold);
+    int depths[] = {1, 8, 64, 256};
+    bool ok = true;
+    for (int i = 0; i < 4; i++)
+        ok = walk(root, depths[i], &cold) == expected && ok;
+
+    if (!cold)
+        printf("the caches could not be dropped (needs root), all walks were warm\n");
+
+    dircache.loaded = false;
+    ok = repeat(root, false) == expected && ok;
+    ok = repeat(root, true) == expected && ok;
+    printf("listing cache: %zu directories in %.1f MB\n", dircache.count, dircache.used / 1048576.0);
+
+    // Listings larger than the limit are used once and not kept.
+    dircache_evict(0);
+    dircache.limit = 4 << 10;
+    ok = repeat(root, true) == expected && ok;
+    bool fits = dircache.used <= dircache.limit;
+    printf("limit 4 KB: %zu directories in %.1f KB%s\n", dircache.count, dircache.used / 1024.0,
+           fits ? "" : "  OVER THE LIMIT");
+    ok = recent_change() && ok;
+    return ok && fits ? 0 : 1;
+}
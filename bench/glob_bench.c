@@ -0,0 +1,91 @@
+// Glob expansion of parse_command() against glob() of the C library, in a
+// directory with many entries. Both sort their matches, and both have to
+// find the same ones in the same order. A '?' at the end of a command line
+// has to be expanded as well.
+//
+// The directory is created in /tmp and kept for the next run.
+//
+// Usage: glob_bench [entries]
+
+#define main shellfyre_main
+#include "../shellfyre.c"
+#undef main
+
+#include <glob.h>
+#include <math.h>
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Best of five expansions with each, in milliseconds.
+static bool run(const char *pattern) {
+    double ours = 1e9, libc = 1e9;
+    struct arg_arena arena = {0};
+    glob_t matches;
+    bool same = true;
+
+    for (int round = 0; round < 5; round++) {
+        struct command_t command = {0};
+        double start = now_ms();
+        arena = (struct arg_arena) {0};
+        glob_expand(pattern, &arena);
+        arena_finish(&arena, &command);
+        ours = fmin(ours, now_ms() - start);
+
+        start = now_ms();
+        int result = glob(pattern, 0, NULL, &matches);
+        libc = fmin(libc, now_ms() - start);
+
+        same = (result == 0 ? (size_t) command.arg_count == matches.gl_pathc : command.arg_count == 0) && same;
+        for (int i = 0; same && i < command.arg_count; i++)
+            same = strcmp(command.args[i], matches.gl_pathv[i]) == 0;
+        printf(round == 4 ? "%-10s %8d matches  parse_command %8.2f ms  glob() %8.2f ms  %s\n" : "",
+               pattern, command.arg_count, ours, libc, same ? "same" : "DIFFERENT");
+        if (result == 0)
+            globfree(&matches);
+        free(command.args);
+        free(command.arg_text);
+    }
+    return same;
+}
+
+// A '?' typed at the end of a line is a pattern like any other, Tab asks for
+// completion without adding one.
+static bool question_mark() {
+    char line[] = "ls file10.?";
+    struct command_t command = {0};
+
+    parse_command(line, &command);
+    bool ok = !command.auto_complete && command.arg_count == 1 && strcmp(command.args[0], "file10.c") == 0;
+    printf("%-10s %8d matches  %s\n", "ls file10.?", command.arg_count, ok ? "expanded" : "WRONG");
+    free(command.name);
+    free(command.args);
+    free(command.arg_text);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    int entries = argc > 1 ? atoi(argv[1]) : 100000;
+    char root[128], path[256];
+
+    snprintf(root, sizeof(root), "/tmp/shellfyre_glob_bench_%d", entries);
+    if (access(root, F_OK) != 0) {
+        mkdir(root, 0700);
+        for (int i = 0; i < entries; i++) {
+            snprintf(path, sizeof(path), "%s/file%d.%s", root, i, i % 10 ? "txt" : "c");
+            close(open(path, O_WRONLY | O_CREAT, 0600));
+        }
+    }
+    if (chdir(root) != 0)
+        return 1;
+
+    bool ok = run("*");
+    ok = run("*.c") && ok;
+    ok = run("file1?[0-4]*") && ok;
+    ok = run("nothing*") && ok;
+    ok = question_mark() && ok;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,70 @@
+// Per-keystroke latency of the Ctrl+R history search.
+//
+// Usage: history_bench [entries]
+
+#define main shellfyre_main
+#include "../shellfyre.c"
+#undef main
+
+#include <time.h>
+
+static const char *commands[] = {"ls -la", "cd", "git status", "git commit -m", "make", "vim", "grep -rn", "cat", "ssh", "docker run", "python3", "filesearch", "pstraverse"};
+static const char *words[] = {"src", "main.c", "Makefile", "build", "/tmp", "README.md", "fix", "todo", "-r", "-o", "origin", "master", "test"};
+
+static const char *queries[] = {"git", "make build", "grep -rn src", "docker run test", "ssh host42", "zzz-not-there", "vim main.c 9", "cd /tmp/x"};
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[]) {
+    int entries = argc > 1 ? atoi(argv[1]) : 1000000;
+    char line[256];
+
+    srand(42);
+    history.loaded = true;
+    history.max_size = entries;
+    history.index = calloc(HISTORY_BUCKETS, sizeof(struct posting_list));
+
+    double start = now_us();
+    for (int i = 0; i < entries; i++) {
+        int len = snprintf(line, sizeof(line), "%s", commands[rand() % 13]);
+        for (int w = rand() % 4; w >= 0; w--)
+            len += snprintf(line + len, sizeof(line) - len, " %s", words[rand() % 13]);
+        snprintf(line + len, sizeof(line) - len, " host%d", rand() % 1000);
+        history_push(line);
+    }
+    printf("indexed %d entries in %.1f ms\n", entries, (now_us() - start) / 1e3);
+
+    // Type every query one key at a time, then press Ctrl+R ten times.
+    int n = 0;
+    double samples[1024];
+    for (int q = 0; q < 8; q++) {
+        char query[64] = "";
+        int match = -1;
+        for (int k = 0; queries[q][k]; k++) {
+            query[k] = queries[q][k];
+            query[k + 1] = 0;
+            start = now_us();
+            match = history_search(query, history_end());
+            samples[n++] = now_us() - start;
+        }
+        for (int r = 0; r < 10 && match >= 0; r++) {
+            start = now_us();
+            int older = history_search(query, match);
+            samples[n++] = now_us() - start;
+            match = older;
+        }
+    }
+
+    qsort(samples, n, sizeof(double), compare_double);
+    printf("%d keystrokes  p50 %.2f us  p99 %.2f us  max %.2f us\n", n, samples[n / 2], samples[n * 99 / 100], samples[n - 1]);
+    return 0;
+}
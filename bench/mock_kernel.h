@@ -0,0 +1,140 @@
+// User-space stand-ins for the kernel definitions used by pstraverse_core.h.
+
+#ifndef MOCK_KERNEL_H
+#define MOCK_KERNEL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef uint64_t u64;
+
+#define TASK_COMM_LEN 16
+#define PAGE_SHIFT 12
+#define NSEC_PER_MSEC 1000000ULL
+#define KERN_INFO ""
+#define GFP_ATOMIC 0
+#define GFP_KERNEL 0
+
+#define printk printf
+
+struct list_head {
+    struct list_head *next, *prev;
+};
+
+#define LIST_HEAD_INIT(name) { &(name), &(name) }
+#define LIST_HEAD(name) struct list_head name = LIST_HEAD_INIT(name)
+
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+#define list_first_entry(ptr, type, member) list_entry((ptr)->next, type, member)
+#define list_next_entry(pos, member) list_entry((pos)->member.next, __typeof__(*(pos)), member)
+#define list_for_each(pos, head) for (pos = (head)->next; pos != (head); pos = pos->next)
+#define list_for_each_entry(pos, head, member) \
+    for (pos = list_first_entry(head, __typeof__(*pos), member); &pos->member != (head); \
+         pos = list_next_entry(pos, member))
+#define list_for_each_entry_safe(pos, n, head, member) \
+    for (pos = list_first_entry(head, __typeof__(*pos), member), n = list_next_entry(pos, member); \
+         &pos->member != (head); pos = n, n = list_next_entry(n, member))
+
+static inline void INIT_LIST_HEAD(struct list_head *list) {
+    list->next = list;
+    list->prev = list;
+}
+
+static inline void list_add_tail(struct list_head *entry, struct list_head *head) {
+    entry->prev = head->prev;
+    entry->next = head;
+    head->prev->next = entry;
+    head->prev = entry;
+}
+
+static inline void list_del(struct list_head *entry) {
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+}
+
+static inline bool list_empty(const struct list_head *head) {
+    return head->next == head;
+}
+
+static inline bool list_is_last(const struct list_head *list, const struct list_head *head) {
+    return list->next == head;
+}
+
+// Only the fields the traversal code reads; the accessors below stand in for
+// the ones the module implements on top of mm_struct and signal_struct.
+struct task_struct {
+    pid_t pid;
+    long uid;
+    unsigned long rss;
+    u64 cputime;
+    unsigned int threads;
+    char comm[TASK_COMM_LEN];
+    struct task_struct *real_parent;
+    struct list_head children;
+    struct list_head sibling;
+};
+
+static inline long task_uid_nr(struct task_struct *task) {
+    return task->uid;
+}
+
+static inline unsigned long task_rss(struct task_struct *task) {
+    return task->rss;
+}
+
+static inline u64 task_cputime(struct task_struct *task) {
+    return task->cputime;
+}
+
+static inline unsigned int task_threads(struct task_struct *task) {
+    return task->threads;
+}
+
+// Traversal allocations are counted, so the benchmark can report their peak.
+struct mock_alloc_header {
+    size_t size;
+    size_t pad;
+};
+
+static size_t mock_live_bytes;
+static size_t mock_peak_bytes;
+
+static inline void *kmalloc(size_t size, int flags) {
+    struct mock_alloc_header *header = malloc(sizeof(*header) + size);
+
+    if (!header)
+        return NULL;
+    header->size = size;
+    mock_live_bytes += size;
+    if (mock_live_bytes > mock_peak_bytes)
+        mock_peak_bytes = mock_live_bytes;
+    return header + 1;
+}
+
+static inline void kfree(const void *ptr) {
+    struct mock_alloc_header *header;
+
+    if (!ptr)
+        return;
+    header = (struct mock_alloc_header *)ptr - 1;
+    mock_live_bytes -= header->size;
+    free(header);
+}
+
+static inline void *kvmalloc_array(size_t n, size_t size, int flags) {
+    return kmalloc(n * size, flags);
+}
+
+#define kvfree kfree
+
+static inline void sort(void *base, size_t num, size_t size, int (*cmp)(const void *, const void *), void *swap) {
+    qsort(base, num, size, cmp);
+}
+
+#endif
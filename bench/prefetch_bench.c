@@ -0,0 +1,110 @@
+// Latency from fork() to the first instruction of a program whose binary and
+// libraries are not cached, with and without the speculative prefetch of the
+// prompt. The prefetch runs before the fork, like while the rest of the line
+// is typed. The caches are dropped before every run, which needs root;
+// otherwise the runs are warm and say so.
+//
+// Usage: prefetch_bench [runs] [command...]
+
+#define main shellfyre_main
+#include "../shellfyre.c"
+#undef main
+
+static char probe[PATH_MAX];
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static bool drop_caches() {
+    sync();
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    bool dropped = fd >= 0 && write(fd, "3", 1) == 1;
+    if (fd >= 0)
+        close(fd);
+
+    // The probe is not part of the measured program.
+    char buf[65536];
+    fd = open(probe, O_RDONLY);
+    while (fd >= 0 && read(fd, buf, sizeof(buf)) > 0)
+        ;
+    close(fd);
+    return dropped;
+}
+
+// Waits until the prefetch thread is done with the last request.
+static double prefetch_wait() {
+    double start = now_ms();
+    pthread_mutex_lock(&prefetch.lock);
+    while (prefetch.done != prefetch.generation)
+        pthread_cond_wait(&prefetch.wake, &prefetch.lock);
+    pthread_mutex_unlock(&prefetch.lock);
+    return now_ms() - start;
+}
+
+// Runs the program until its first instruction and returns the time since fork().
+static double exec_latency(const char *path) {
+    int fds[2];
+    long long first;
+    char fd_text[16];
+
+    pipe(fds);
+    snprintf(fd_text, sizeof(fd_text), "%d", fds[1]);
+    double start = now_ms();
+    pid_t pid = fork();
+    if (pid == 0) {
+        char *args[] = {(char *) path, "--version", NULL};
+        setenv("LD_PRELOAD", probe, 1);
+        setenv("PREFETCH_PROBE_FD", fd_text, 1);
+        execv(path, args);
+        _exit(127);
+    }
+    close(fds[1]);
+    bool ok = read(fds[0], &first, sizeof(first)) == sizeof(first);
+    close(fds[0]);
+    waitpid(pid, NULL, 0);
+    return ok ? first / 1e6 - start : -1;
+}
+
+int main(int argc, char *argv[]) {
+    int runs = argc > 1 ? atoi(argv[1]) : 5;
+    const char *defaults[] = {"perl", "git", "vim", "ssh", "curl", NULL};
+    const char **names = argc > 2 ? (const char **) argv + 2 : defaults;
+    bool cold = true;
+
+    realpath("bench/prefetch_probe.so", probe);
+    if (access(probe, R_OK) != 0) {
+        printf("bench/prefetch_probe.so is missing, build it with make bench\n");
+        return 1;
+    }
+    prefetch.enabled = true;
+
+    printf("%-8s %14s %14s %14s\n", "command", "no prefetch", "prefetched", "prefetch took");
+    for (int i = 0; names[i]; i++) {
+        char *path = find_path((char *) names[i]);
+        if (path == NULL)
+            continue;
+
+        double plain = 0, prefetched = 0, took = 0;
+        for (int run = 0; run < runs; run++) {
+            cold = drop_caches() && cold;
+            plain += exec_latency(path);
+
+            cold = drop_caches() && cold;
+            memset(prefetch.recent, 0, sizeof(prefetch.recent));
+            prefetch_request(names[i]);
+            took += prefetch_wait();
+            prefetched += exec_latency(path);
+            prefetch_request("");
+            prefetch_wait();
+        }
+        printf("%-8s %11.2f ms %11.2f ms %11.2f ms\n", names[i], plain / runs, prefetched / runs, took / runs);
+        free(path);
+    }
+
+    if (!cold)
+        printf("the caches could not be dropped (needs root), all runs were warm\n");
+    return 0;
+}
@@ -0,0 +1,287 @@
+// Benchmark of the pstraverse traversal algorithms on synthetic process trees.
+// The code under test is pstraverse_core.h, built against bench/mock_kernel.h,
+// so it runs without root and without loading the module.
+//
+// Usage: pstraverse_bench [max_nodes]
+
+#define _GNU_SOURCE
+
+#include "mock_kernel.h"
+#include "../pstraverse_core.h"
+
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+enum shape {
+    CHAIN,
+    WIDE,
+    RANDOM,
+};
+
+static const char *shape_names[] = {"chain", "wide", "random"};
+
+// Parent of every node, parent[i] < i, so node 0 is the root.
+static int *make_parents(enum shape shape, int n) {
+    int *parent = malloc(sizeof(int) * n);
+
+    parent[0] = -1;
+    for (int i = 1; i < n; i++) {
+        if (shape == CHAIN)
+            parent[i] = i - 1;
+        else if (shape == WIDE)
+            parent[i] = 0;
+        else
+            parent[i] = rand() % i;
+    }
+
+    return parent;
+}
+
+static struct task_struct *make_tree(const int *parent, int n) {
+    struct task_struct *tasks = calloc(n, sizeof(struct task_struct));
+
+    for (int i = 0; i < n; i++) {
+        struct task_struct *task = &tasks[i];
+
+        task->pid = i + 1;
+        task->uid = i % 4;
+        task->rss = 1 + rand() % 4096;
+        task->cputime = (u64)(rand() % 1000) * NSEC_PER_MSEC;
+        task->threads = 1 + rand() % 8;
+        snprintf(task->comm, sizeof(task->comm), "task%d", i % 1000);
+        INIT_LIST_HEAD(&task->children);
+        INIT_LIST_HEAD(&task->sibling);
+
+        if (parent[i] >= 0) {
+            task->real_parent = &tasks[parent[i]];
+            list_add_tail(&task->sibling, &tasks[parent[i]].children);
+        } else {
+            task->real_parent = task;
+        }
+    }
+
+    return tasks;
+}
+
+// Reference orders computed from the parent array with an explicit stack and queue.
+static int *reference_order(const int *parent, int n, bool dfs) {
+    int *first_child = malloc(sizeof(int) * n);
+    int *next_sibling = malloc(sizeof(int) * n);
+    int *last_child = malloc(sizeof(int) * n);
+    int *order = malloc(sizeof(int) * n);
+    int *work = malloc(sizeof(int) * n);
+    int count = 0;
+
+    for (int i = 0; i < n; i++)
+        first_child[i] = next_sibling[i] = last_child[i] = -1;
+    for (int i = 1; i < n; i++) {
+        if (last_child[parent[i]] < 0)
+            first_child[parent[i]] = i;
+        else
+            next_sibling[last_child[parent[i]]] = i;
+        last_child[parent[i]] = i;
+    }
+
+    if (dfs) {
+        int top = 0;
+        work[top++] = 0;
+        while (top > 0) {
+            int node = work[--top];
+            order[count++] = node;
+
+            // Push the children in reverse, so the first child is popped first.
+            int children = 0;
+            for (int c = first_child[node]; c >= 0; c = next_sibling[c])
+                children++;
+            top += children;
+            int slot = top - 1;
+            for (int c = first_child[node]; c >= 0; c = next_sibling[c])
+                work[slot--] = c;
+        }
+    } else {
+        int head = 0, tail = 0;
+        work[tail++] = 0;
+        while (head < tail) {
+            int node = work[head++];
+            order[count++] = node;
+            for (int c = first_child[node]; c >= 0; c = next_sibling[c])
+                work[tail++] = c;
+        }
+    }
+
+    free(first_child);
+    free(next_sibling);
+    free(last_child);
+    free(work);
+    return order;
+}
+
+static bool check_order(struct ps_traversal *t, struct task_struct *tasks, const int *order, int n) {
+    char expected[64];
+    char *cursor = t->buf;
+
+    for (int i = 0; i < n; i++) {
+        int len = snprintf(expected, sizeof(expected), "Name: %s PID: %d\n", tasks[order[i]].comm, tasks[order[i]].pid);
+        if (strncmp(cursor, expected, len) != 0)
+            return false;
+        cursor += len;
+    }
+
+    return cursor == t->buf + t->len;
+}
+
+// Subtree totals of the aggregation pass against sums over the parent array.
+static bool check_aggregation(struct ps_agg_node *nodes, unsigned int count, struct task_struct *tasks, const int *parent, int n) {
+    unsigned long *rss = malloc(sizeof(unsigned long) * n);
+    unsigned int *tasks_below = malloc(sizeof(unsigned int) * n);
+    bool ok = count == (unsigned int)n;
+
+    for (int i = 0; i < n; i++) {
+        rss[i] = tasks[i].rss;
+        tasks_below[i] = 1;
+    }
+    for (int i = n - 1; i > 0; i--) {
+        rss[parent[i]] += rss[i];
+        tasks_below[parent[i]] += tasks_below[i];
+    }
+
+    for (unsigned int i = 0; ok && i < count; i++) {
+        int index = nodes[i].task - tasks;
+        ok = nodes[i].rss == rss[index] && nodes[i].tasks == tasks_below[index];
+    }
+
+    free(rss);
+    free(tasks_below);
+    return ok;
+}
+
+static int perf_fd = -1;
+
+// Counts cache misses of this process, if the kernel lets us.
+static void perf_open(void) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    perf_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void perf_start(void) {
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+static long long perf_stop(void) {
+    long long count = -1;
+
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(perf_fd, &count, sizeof(count)) != sizeof(count))
+            count = -1;
+    }
+
+    return count;
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void report(const char *shape, int n, const char *algorithm, double ms, long long misses, bool ok) {
+    char misses_text[32] = "n/a";
+
+    if (misses >= 0)
+        snprintf(misses_text, sizeof(misses_text), "%lld", misses);
+
+    printf("%-7s %8d  %-9s %10.3f %12zu %14s  %s\n", shape, n, algorithm, ms, mock_peak_bytes, misses_text, ok ? "ok" : "MISMATCH");
+}
+
+static bool run(enum shape shape, int n) {
+    int *parent = make_parents(shape, n);
+    struct task_struct *tasks = make_tree(parent, n);
+    struct ps_traversal t;
+    bool all_ok = true;
+
+    memset(&t, 0, sizeof(t));
+    t.size = (size_t)n * 32 + 1;
+    t.buf = malloc(t.size);
+
+    for (int dfs = 1; dfs >= 0; dfs--) {
+        int *order = reference_order(parent, n, dfs);
+
+        ps_init_filter(&t.filter);
+        t.len = t.visited = t.matched = 0;
+        t.truncated = false;
+        mock_peak_bytes = mock_live_bytes;
+
+        perf_start();
+        double start = now_ms();
+        if (dfs)
+            DFS(&tasks[0], &t);
+        else
+            BFS(&tasks[0], &t);
+        double ms = now_ms() - start;
+        long long misses = perf_stop();
+
+        bool ok = check_order(&t, tasks, order, n);
+        report(shape_names[shape], n, dfs ? "dfs" : "bfs", ms, misses, ok);
+        all_ok = all_ok && ok;
+        free(order);
+    }
+
+    mock_peak_bytes = mock_live_bytes;
+    perf_start();
+    double start = now_ms();
+    unsigned int size = count_tasks(&tasks[0]);
+    struct ps_agg_node *nodes = kvmalloc_array(size, sizeof(*nodes), GFP_KERNEL);
+    unsigned int count = fill_nodes(&tasks[0], nodes, size);
+    fold_nodes(nodes, count);
+    ps_init_filter(&t.filter);
+    t.len = t.visited = t.matched = 0;
+    emit_heaviest(nodes, count, &t);
+    double ms = now_ms() - start;
+    long long misses = perf_stop();
+
+    bool ok = check_aggregation(nodes, count, tasks, parent, n) && nodes[0].task == &tasks[0] && t.matched == 10;
+    report(shape_names[shape], n, "aggregate", ms, misses, ok);
+    all_ok = all_ok && ok;
+
+    kvfree(nodes);
+    free(t.buf);
+    free(tasks);
+    free(parent);
+    return all_ok;
+}
+
+int main(int argc, char *argv[]) {
+    int max_nodes = argc > 1 ? atoi(argv[1]) : 1000000;
+    bool ok = true;
+    struct rusage usage;
+
+    srand(42);
+    perf_open();
+
+    printf("%-7s %8s  %-9s %10s %12s %14s  %s\n", "shape", "nodes", "algorithm", "time (ms)", "peak (B)", "cache misses", "check");
+    for (int n = 1000; n <= max_nodes; n *= 10) {
+        for (int shape = CHAIN; shape <= RANDOM; shape++)
+            ok = run(shape, n) && ok;
+    }
+
+    getrusage(RUSAGE_SELF, &usage);
+    printf("max resident set: %ld kB\n", usage.ru_maxrss);
+
+    return ok ? 0 : 1;
+}
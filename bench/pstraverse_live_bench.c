@@ -0,0 +1,406 @@
+// Benchmark of the loaded pstraverse module on a real process tree. It forks a
+// tree of sleeping processes (50 branches of 1000 leaves by default, so 50051
+// processes) and times requests through the device file with and without the
+// in-kernel filters, reporting the bytes copied out for each. The traversals
+// then run again on the process tree cache, which has to give the same output,
+// and the heaviest subtrees of -a are checked against the /proc backend of the
+// shell, which sums /proc/<pid>/stat over the same tree, with both timed,
+// and the cost of the cache probes is measured on fork, exit and wait cycles,
+// with and without a grandchild that gets reparented. Last, processes whose
+// threads all exit at once check that the cache still matches the live tree.
+//
+// Needs root and the module (sudo insmod pstraverse.ko), and a process limit
+// above the size of the tree. `make live-bench` builds, loads and runs it.
+//
+// Usage: pstraverse_live_bench [tasks] [device]
+
+#define main shellfyre_main
+#include "../shellfyre.c"
+#undef main
+
+#include <sys/prctl.h>
+
+#define BRANCHES 50
+#define RUNS 10
+#define FORKS 20000
+#define THREADS 8
+
+static const char *device = "/dev/my_device";
+static char *out, *walked;
+static size_t out_size = 1 << 22;
+static ssize_t walked_len;
+static pthread_barrier_t exit_barrier;
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// Forks the tree below the calling process and returns its root, which is
+// the leader of a process group, so the tree is killed with one signal. Every
+// process reports to the pipe once its own children exist.
+static pid_t make_tree(int tasks) {
+    int ready[2];
+    int leaves = (tasks - 1 - BRANCHES) / BRANCHES;
+    char byte;
+
+    if (pipe(ready) != 0)
+        return -1;
+
+    pid_t root = fork();
+    if (root == 0) {
+        setpgid(0, 0);
+        prctl(PR_SET_NAME, "psb_root");
+        for (int b = 0; b < BRANCHES; b++) {
+            if (fork() == 0) {
+                prctl(PR_SET_NAME, "psb_branch");
+                for (int l = 0; l < leaves; l++) {
+                    if (fork() == 0) {
+                        prctl(PR_SET_NAME, "psb_leaf");
+                        close(ready[1]);
+                        pause();
+                        _exit(0);
+                    }
+                }
+                write(ready[1], "b", 1);
+                pause();
+                _exit(0);
+            }
+        }
+        pause();
+        _exit(0);
+    }
+
+    close(ready[1]);
+    for (int b = 0; b < BRANCHES; b++)
+        if (read(ready[0], &byte, 1) != 1)
+            break;
+    close(ready[0]);
+    return root;
+}
+
+static void kill_tree(pid_t root) {
+    kill(-root, SIGKILL);
+    waitpid(root, NULL, 0);
+}
+
+// Sends a request and reads its records, returns the bytes read or -1.
+static ssize_t request(const char *line) {
+    int fd = open(device, O_RDWR);
+    ssize_t total = 0, n;
+
+    if (fd < 0)
+        return -1;
+    if (write(fd, line, strlen(line)) != (ssize_t) strlen(line)) {
+        close(fd);
+        return -1;
+    }
+    while ((n = read(fd, out + total, out_size - total)) > 0)
+        total += n;
+    close(fd);
+    return total;
+}
+
+static bool set_cache(bool on) {
+    int fd = open(device, O_WRONLY);
+    const char *line = on ? "cache on" : "cache off";
+    bool ok = fd >= 0 && write(fd, line, strlen(line)) == (ssize_t) strlen(line);
+
+    if (fd >= 0)
+        close(fd);
+    if (!ok)
+        printf("%s: %s\n", line, strerror(errno));
+    return ok;
+}
+
+// Median time of a request over RUNS runs.
+static bool query(pid_t root, const char *name, const char *options) {
+    char line[256];
+    double samples[RUNS];
+    ssize_t bytes = 0;
+
+    snprintf(line, sizeof(line), "%d %s", root, options);
+    for (int i = 0; i < RUNS; i++) {
+        double start = now_us();
+        if ((bytes = request(line)) < 0) {
+            printf("%s: %s\n", line, strerror(errno));
+            return false;
+        }
+        samples[i] = now_us() - start;
+    }
+    qsort(samples, RUNS, sizeof(double), compare_double);
+    printf("%-24s %-36s %10.1f us %10zd bytes\n", name, options, samples[RUNS / 2], bytes);
+    return true;
+}
+
+// Runs a request on the live tree and then on the cache, which has to give
+// the same records.
+static bool compare(pid_t root, const char *name, const char *options) {
+    char line[256], label[64];
+    bool same;
+
+    snprintf(line, sizeof(line), "%d %s", root, options);
+    snprintf(label, sizeof(label), "%s, walk", name);
+    if (!set_cache(false) || !query(root, label, options))
+        return false;
+    walked_len = request(line);
+    memcpy(walked, out, walked_len > 0 ? walked_len : 0);
+
+    snprintf(label, sizeof(label), "%s, cache", name);
+    if (!set_cache(true) || !query(root, label, options))
+        return false;
+    same = request(line) == walked_len && memcmp(out, walked, walked_len) == 0;
+    printf("%-24s %-36s %s as the walk\n", name, options, same ? "same" : "DIFFERENT");
+    return same;
+}
+
+// One line of -a output.
+struct subtree {
+    char name[16];
+    pid_t pid;
+    unsigned long rss_kb;
+    unsigned long long cpu_ms;
+    unsigned int threads, tasks;
+};
+
+static int parse_subtrees(char *text, ssize_t len, struct subtree *subtrees, int size) {
+    char *line = text, *end;
+    int n = 0;
+
+    if (len < 0 || (size_t) len >= out_size)
+        return 0;
+    text[len] = '\0';
+    while (n < size && (end = strchr(line, '\n')) != NULL) {
+        struct subtree *s = &subtrees[n];
+        if (sscanf(line, "Name: %15s PID: %d RSS: %lu kB CPU: %llu ms Threads: %u Tasks: %u", s->name, &s->pid,
+                   &s->rss_kb, &s->cpu_ms, &s->threads, &s->tasks) == 6)
+            n++;
+        line = end + 1;
+    }
+    return n;
+}
+
+// Runs -a on the /proc backend of the shell with the records in out and
+// returns their length.
+static ssize_t proc_aggregate(pid_t root, int max) {
+    FILE *records = tmpfile();
+    int saved = dup(STDOUT_FILENO);
+    ssize_t len;
+
+    if (!records)
+        return -1;
+    fflush(stdout);
+    dup2(fileno(records), STDOUT_FILENO);
+    pstraverse_proc(root, 'a', -1, "", "", -1, max);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    len = pread(fileno(records), out, out_size, 0);
+    fclose(records);
+    return len;
+}
+
+// The heaviest subtrees of the module against the sums the /proc backend makes
+// of the same tree. The root and the branches are the heaviest BRANCHES + 1
+// subtrees in both, with the same names, RSS, threads and tasks. CPU time is
+// kept in ticks in /proc, so it may differ by a tick for every process.
+static bool compare_aggregate(pid_t root) {
+    static struct subtree module[BRANCHES + 1], proc[BRANCHES + 1];
+    char line[64], options[32];
+    double samples[RUNS];
+    ssize_t len = 0;
+    int n, m, same = 0;
+    long tick_ms = 1000 / sysconf(_SC_CLK_TCK);
+
+    snprintf(options, sizeof(options), "-a max=%d", BRANCHES + 1);
+    snprintf(line, sizeof(line), "%d %s", root, options);
+    if (!set_cache(false) || !query(root, "aggregate, module", options))
+        return false;
+    n = parse_subtrees(out, request(line), module, BRANCHES + 1);
+
+    for (int i = 0; i < RUNS; i++) {
+        double start = now_us();
+        if ((len = proc_aggregate(root, BRANCHES + 1)) < 0)
+            return false;
+        samples[i] = now_us() - start;
+    }
+    qsort(samples, RUNS, sizeof(double), compare_double);
+    printf("%-24s %-36s %10.1f us %10zd bytes\n", "aggregate, /proc", options, samples[RUNS / 2], len);
+    m = parse_subtrees(out, len, proc, BRANCHES + 1);
+
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < m; j++) {
+            struct subtree *a = &module[i], *b = &proc[j];
+            if (a->pid != b->pid)
+                continue;
+            unsigned long long cpu_diff = a->cpu_ms > b->cpu_ms ? a->cpu_ms - b->cpu_ms : b->cpu_ms - a->cpu_ms;
+            same += strcmp(a->name, b->name) == 0 && a->rss_kb == b->rss_kb && a->threads == b->threads
+                && a->tasks == b->tasks && cpu_diff <= (unsigned long long) a->tasks * tick_ms;
+        }
+    }
+    printf("%-24s %-36s %d of %d subtrees as in /proc\n", "aggregate", options, same, BRANCHES + 1);
+    return n == BRANCHES + 1 && m == n && same == n;
+}
+
+// Mean time of a fork, exit and wait cycle in microseconds. With reparent,
+// every child forks a grandchild that outlives it and is adopted by this
+// process, a subreaper.
+static double fork_cycle(bool reparent) {
+    double start = now_us();
+    int hold[2];
+    char byte;
+
+    for (int i = 0; i < FORKS; i++) {
+        if (reparent && pipe(hold) != 0)
+            return -1;
+        pid_t child = fork();
+        if (child == 0) {
+            if (reparent && fork() == 0) {
+                close(hold[1]);
+                read(hold[0], &byte, 1); // until the write end is closed
+                _exit(0);
+            }
+            _exit(0);
+        }
+        waitpid(child, NULL, 0);
+        if (reparent) {
+            close(hold[0]);
+            close(hold[1]);
+            wait(NULL);
+        }
+    }
+    return (now_us() - start) / FORKS;
+}
+
+static bool fork_cost(bool cache) {
+    double plain, reparent;
+
+    if (!set_cache(cache))
+        return false;
+    plain = fork_cycle(false);
+    reparent = fork_cycle(true);
+    printf("%-24s fork+exit+wait %8.2f us   with a reparented grandchild %8.2f us\n",
+           cache ? "cache on" : "cache off", plain, reparent);
+    return plain > 0 && reparent > 0;
+}
+
+// Ends the calling thread only, after every thread of the process got here.
+static void *exit_thread(void *arg) {
+    pthread_barrier_wait(&exit_barrier);
+    syscall(SYS_exit, 0);
+    return NULL;
+}
+
+// Mean time of a cycle in which a process with THREADS threads besides the
+// main one ends with all of them exiting at the same moment, so several can
+// see no live thread left. Its child outlives it and puts it on the orphan
+// list of the cache.
+static double thread_exit_cycle(int cycles) {
+    double start = now_us();
+    int hold[2];
+    char byte;
+
+    for (int i = 0; i < cycles; i++) {
+        if (pipe(hold) != 0)
+            return -1;
+        pid_t child = fork();
+        if (child == 0) {
+            pthread_t thread;
+            if (fork() == 0) {
+                close(hold[1]);
+                read(hold[0], &byte, 1);
+                _exit(0);
+            }
+            pthread_barrier_init(&exit_barrier, NULL, THREADS + 1);
+            for (int t = 0; t < THREADS; t++)
+                pthread_create(&thread, NULL, exit_thread, NULL);
+            exit_thread(NULL);
+        }
+        waitpid(child, NULL, 0);
+        close(hold[0]);
+        close(hold[1]);
+        wait(NULL);
+    }
+    return (now_us() - start) / cycles;
+}
+
+// The cache kept up to date through the exits has to give the records of a
+// walk of the live tree below this process.
+static bool thread_exits(void) {
+    char line[64];
+    ssize_t cached;
+    bool same;
+
+    if (!set_cache(true))
+        return false;
+    double us = thread_exit_cycle(FORKS / 10);
+    usleep(100000); // for the reparenting work of the last exits
+    snprintf(line, sizeof(line), "%d -d", getpid());
+    cached = request(line);
+    memcpy(walked, out, cached > 0 ? cached : 0);
+    if (!set_cache(false))
+        return false;
+    same = cached > 0 && request(line) == cached && memcmp(out, walked, cached) == 0;
+    printf("%-24s %d threads exiting at once %8.2f us, cache %s as the walk\n", "cache on", THREADS + 1, us,
+           same ? "same" : "DIFFERENT");
+    return us > 0 && same;
+}
+
+int main(int argc, char *argv[]) {
+    int tasks = argc > 1 ? atoi(argv[1]) : 50051;
+    bool ok = true;
+
+    if (argc > 2)
+        device = argv[2];
+    if (access(device, W_OK) != 0) {
+        printf("%s: %s, load the module with sudo insmod pstraverse.ko and run as root\n", device, strerror(errno));
+        return 1;
+    }
+    out = malloc(out_size);
+    walked = malloc(out_size);
+    prctl(PR_SET_CHILD_SUBREAPER, 1);
+
+    double start = now_us();
+    pid_t root = make_tree(tasks);
+    if (root < 0)
+        return 1;
+    printf("forked %d processes in %.1f s\n", tasks, (now_us() - start) / 1e6);
+
+    printf("%-24s %-36s %13s %16s\n", "traversal", "options", "median", "copied");
+    ok = set_cache(false) && ok;
+    ok = query(root, "dfs", "-d") && ok;
+    ok = query(root, "bfs", "-b") && ok;
+    ok = query(root, "dfs depth limit", "-d depth=1") && ok;
+    ok = query(root, "dfs prefix filter", "-d prefix=psb_branch") && ok;
+    ok = query(root, "dfs substring filter", "-d match=root") && ok;
+    ok = query(root, "dfs both name filters", "-d prefix=psb match=branch") && ok;
+    ok = query(root, "dfs record limit", "-d max=100") && ok;
+    ok = query(root, "bfs depth limit", "-b depth=1") && ok;
+    ok = query(root, "aggregate", "-a") && ok;
+
+    printf("\n");
+    ok = compare(root, "dfs", "-d") && ok;
+    ok = compare(root, "bfs", "-b") && ok;
+    ok = compare(root, "dfs prefix filter", "-d prefix=psb_branch") && ok;
+    ok = compare(root, "dfs depth limit", "-d depth=1") && ok;
+    ok = compare_aggregate(root) && ok;
+
+    // Idle tasks on top of the tree, to give the cache probes a realistic
+    // index to look up in.
+    printf("\n");
+    ok = fork_cost(false) && ok;
+    ok = fork_cost(true) && ok;
+    ok = thread_exits() && ok;
+    set_cache(false);
+
+    kill_tree(root);
+    free(walked);
+    free(out);
+    return ok ? 0 : 1;
+}
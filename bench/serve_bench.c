@@ -0,0 +1,253 @@
+// Load generator for `shellfyre --serve`: requests per second and latency of a
+// builtin and an external command with a growing number of clients, each
+// sending its next command when the last one is done, and with clients that
+// connect again for every command. Then checks that commands sent together
+// are all answered in order, that a bad frame behind them ends the session,
+// and that a server short of descriptors still answers.
+//
+// Usage: serve_bench [requests per client]
+
+#define main shellfyre_main
+#include "../shellfyre.c"
+#undef main
+
+#include <sys/resource.h>
+#include <time.h>
+
+static char socket_path[108];
+static int requests = 200;
+
+struct client_run {
+    pthread_t thread;
+    const char *line;
+    bool reconnect;
+    double *samples;
+    int failed;
+};
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static bool read_all(int fd, void *buf, size_t len) {
+    for (size_t done = 0; done < len;) {
+        ssize_t n = read(fd, (char *) buf + done, len - done);
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+static int connect_server() {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    strcpy(address.sun_path, socket_path);
+    if (connect(fd, (struct sockaddr *) &address, sizeof(address)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Appends a frame to buf and returns its length.
+static size_t frame(char *buf, char type, const char *data) {
+    uint32_t size = htonl(strlen(data));
+
+    buf[0] = type;
+    memcpy(buf + 1, &size, 4);
+    memcpy(buf + 5, data, strlen(data));
+    return 5 + strlen(data);
+}
+
+// Reads frames up to an exit status and returns their type, the output goes
+// to out if given.
+static char response(int fd, char *out, size_t out_size) {
+    size_t out_len = 0;
+    uint32_t size;
+
+    while (1) {
+        char header[5], data[4096];
+        if (!read_all(fd, header, 5))
+            return 0;
+        memcpy(&size, header + 1, 4);
+        size = ntohl(size);
+        for (uint32_t left = size; left > 0;) {
+            uint32_t chunk = left < sizeof(data) ? left : sizeof(data);
+            if (!read_all(fd, data, chunk))
+                return 0;
+            if (out && header[0] == 'O' && out_len + chunk < out_size) {
+                memcpy(out + out_len, data, chunk);
+                out_len += chunk;
+            }
+            left -= chunk;
+        }
+        if (out)
+            out[out_len] = 0;
+        if (header[0] == 'X' || header[0] == 'E')
+            return header[0];
+    }
+}
+
+// Sends a command line and reads frames up to its exit status.
+static bool request(int fd, const char *line) {
+    char buf[512];
+    size_t len = frame(buf, 'C', line);
+
+    return write(fd, buf, len) == (ssize_t) len && response(fd, NULL, 0) == 'X';
+}
+
+static void *client_main(void *arg) {
+    struct client_run *run = arg;
+    int fd = connect_server();
+
+    for (int i = 0; i < requests; i++) {
+        double start = now_us();
+        if (fd < 0 || !request(fd, run->line))
+            run->failed++;
+        if (run->reconnect) {
+            close(fd);
+            fd = connect_server();
+        }
+        run->samples[i] = now_us() - start;
+    }
+    close(fd);
+    return NULL;
+}
+
+// Sends commands in one write, then a good and a bad frame in one write.
+static bool pipelined() {
+    char buf[8192], out[64], want[64];
+    size_t len = 0;
+    bool ok;
+    int fd = connect_server();
+
+    for (int i = 0; i < 64; i++) {
+        snprintf(want, sizeof(want), "echo %d", i);
+        len += frame(buf + len, 'C', want);
+    }
+    ok = fd >= 0 && write(fd, buf, len) == (ssize_t) len;
+    for (int i = 0; ok && i < 64; i++) {
+        snprintf(want, sizeof(want), "%d\n", i);
+        ok = response(fd, out, sizeof(out)) == 'X' && strcmp(out, want) == 0;
+    }
+    printf("%-40s %s\n", "commands sent in one write", ok ? "ok" : "WRONG");
+
+    len = frame(buf, 'C', "true");
+    len += frame(buf + len, 'Z', "");
+    bool closed = ok && write(fd, buf, len) == (ssize_t) len && response(fd, NULL, 0) == 'X'
+                  && response(fd, NULL, 0) == 'E' && read(fd, buf, 1) == 0;
+    printf("%-40s %s\n", "bad frame behind a command", closed ? "ok" : "WRONG");
+    if (fd >= 0)
+        close(fd);
+    return ok && closed;
+}
+
+static bool run(const char *line, int clients, bool reconnect) {
+    struct client_run *runs = calloc(clients, sizeof(struct client_run));
+    double *samples = malloc(sizeof(double) * clients * requests);
+    int failed = 0;
+
+    double start = now_us();
+    for (int i = 0; i < clients; i++) {
+        runs[i].line = line;
+        runs[i].reconnect = reconnect;
+        runs[i].samples = samples + i * requests;
+        pthread_create(&runs[i].thread, NULL, client_main, &runs[i]);
+    }
+    for (int i = 0; i < clients; i++) {
+        pthread_join(runs[i].thread, NULL);
+        failed += runs[i].failed;
+    }
+    double seconds = (now_us() - start) / 1e6;
+
+    int n = clients * requests;
+    qsort(samples, n, sizeof(double), compare_double);
+    printf("%-8s %4d clients%s  %8.0f req/s  p50 %8.1f us  p99 %8.1f us  max %8.1f us%s\n",
+           line, clients, reconnect ? " (reconnecting)" : "", n / seconds, samples[n / 2], samples[n * 99 / 100], samples[n - 1],
+           failed ? "  FAILED" : "");
+
+    free(samples);
+    free(runs);
+    return failed == 0;
+}
+
+static pid_t start_server(int fd_limit) {
+    pid_t server = fork();
+    if (server == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        close(null);
+        if (fd_limit > 0)
+            setrlimit(RLIMIT_NOFILE, &(struct rlimit) {fd_limit, fd_limit});
+        exit(serve_main(socket_path));
+    }
+    for (int i = 0; i < 100 && access(socket_path, F_OK) != 0; i++)
+        usleep(10000);
+    return server;
+}
+
+static void stop_server(pid_t server) {
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    unlink(socket_path);
+}
+
+// Sends a command and returns true if an exit status or an error comes back.
+static bool answered(int fd) {
+    char buf[16];
+    size_t len = frame(buf, 'C', "true");
+    char type;
+
+    return fd >= 0 && write(fd, buf, len) == (ssize_t) len && ((type = response(fd, NULL, 0)) == 'X' || type == 'E');
+}
+
+// With few descriptors left, the pipes of a command cannot all be created.
+// The client gets an error or the exit status, and the server goes on with
+// its next command and its next client.
+static bool out_of_descriptors() {
+    bool ok = true;
+
+    for (int limit = 8; limit <= 16; limit++) {
+        pid_t server = start_server(limit);
+        int fd = connect_server();
+        bool served = answered(fd) && answered(fd);
+        if (fd >= 0)
+            close(fd);
+        fd = connect_server();
+        served = answered(fd) && served;
+        if (fd >= 0)
+            close(fd);
+        stop_server(server);
+        ok = served && ok;
+    }
+    printf("%-40s %s\n", "commands with too few descriptors", ok ? "ok" : "WRONG");
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1)
+        requests = atoi(argv[1]);
+    snprintf(socket_path, sizeof(socket_path), "/tmp/shellfyre_serve_bench_%d.sock", getpid());
+
+    pid_t server = start_server(0);
+    bool ok = true;
+    const char *lines[] = {"cd /tmp", "true"};
+    for (int l = 0; l < 2; l++)
+        for (int clients = 1; clients <= 64; clients *= 8)
+            ok = run(lines[l], clients, false) && ok;
+    ok = run("true", 64, true) && ok;
+    ok = pipelined() && ok;
+    stop_server(server);
+
+    ok = out_of_descriptors() && ok;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,68 @@
+// Overhead of the latency statistics: a parsed command with the statistics
+// turned off and on, against the same work without any timer calls.
+//
+// Usage: stats_bench [commands]
+
+#define main shellfyre_main
+#include "../shellfyre.c"
+#undef main
+
+#include <math.h>
+
+static const char *lines[] = {"ls -la /tmp", "git commit -m \"fix\"", "filesearch -r main", "cd ..", "make -j8 > log"};
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Parses and frees a command, with the timer calls of prompt() if timed.
+static void parse(const char *line, bool timed) {
+    char buf[256];
+    struct command_t *command = calloc(1, sizeof(struct command_t));
+
+    strcpy(buf, line);
+    unsigned long long start = timed ? stats_begin() : 0;
+    parse_command(buf, command);
+    if (timed)
+        stats_phase(PHASE_PARSE, command->name, start);
+    free_command(command);
+}
+
+static double run(long commands, bool timed) {
+    double start = now_ns();
+    for (long i = 0; i < commands; i++)
+        parse(lines[i % 5], timed);
+    return (now_ns() - start) / commands;
+}
+
+int main(int argc, char *argv[]) {
+    long commands = argc > 1 ? atol(argv[1]) : 2000000;
+
+    run(commands / 10, false); // warm up the allocator
+
+    // The three variants take turns and the best round of each counts, so
+    // frequency changes and other load hit them alike.
+    double untimed = 1e9, off = 1e9, on = 1e9;
+    for (int round = 0; round < 5; round++) {
+        untimed = fmin(untimed, run(commands / 5, false));
+        stats.enabled = false;
+        off = fmin(off, run(commands / 5, true));
+        stats.enabled = true;
+        on = fmin(on, run(commands / 5, true));
+    }
+
+    printf("%ld commands  no timers %6.1f ns  stats off %6.1f ns (%+.1f%%)  stats on %6.1f ns (%+.1f%%)\n",
+           commands, untimed, off, (off - untimed) * 100 / untimed, on, (on - untimed) * 100 / untimed);
+
+    // Every parse has to be in the histogram, and the buckets have to add up.
+    unsigned int total = 0;
+    for (int i = 0; i < STATS_BUCKETS; i++)
+        total += stats.phases[PHASE_PARSE].buckets[i];
+    if (stats.phases[PHASE_PARSE].count != commands || total != commands) {
+        printf("histogram holds %u of %ld commands\n", total, commands);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,162 @@
+// Latency of adding and removing tasks in the todo log, and a check of the
+// list after a compaction that fails and one that runs while tasks are added
+// and removed.
+//
+// Usage: todo_bench [tasks]
+
+#define main shellfyre_main
+#include "../shellfyre.c"
+#undef main
+
+#include <time.h>
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static void report(const char *name, double *samples, int n) {
+    double total = 0;
+    for (int i = 0; i < n; i++)
+        total += samples[i];
+    qsort(samples, n, sizeof(double), compare_double);
+    printf("%-22s %8d ops  mean %8.2f us  p50 %8.2f us  p99 %8.2f us  max %8.2f us\n",
+           name, n, total / n, samples[n / 2], samples[n * 99 / 100], samples[n - 1]);
+}
+
+static void run(int n, const char *policy) {
+    char name[64];
+    double *samples = malloc(sizeof(double) * n);
+
+    snprintf(todo_file, sizeof(todo_file), "/tmp/shellfyre_todo_bench_%d.log", getpid());
+    unlink(todo_file);
+    setenv("SHELLFYRE_TODO_FSYNC", policy, 1);
+    todo.loaded = false;
+    todo.next_id = 0;
+
+    for (int i = 0; i < n; i++) {
+        double start = now_us();
+        todo_append("a task that has to be done some day");
+        samples[i] = now_us() - start;
+    }
+    snprintf(name, sizeof(name), "add (fsync %s)", policy);
+    report(name, samples, n);
+
+    // Remove from the middle, which costs the most with a rewriting store.
+    for (int i = 0; i < n; i++) {
+        double start = now_us();
+        todo_remove(todo.count / 2 + 1);
+        samples[i] = now_us() - start;
+    }
+    snprintf(name, sizeof(name), "remove (fsync %s)", policy);
+    report(name, samples, n);
+
+    todo_close();
+    close(todo.fd);
+    todo.fd = -1;
+    unlink(todo_file);
+    free(samples);
+}
+
+// The list as it should be, task numbers in order.
+static int expected[1024];
+static int expected_count;
+
+static void add(int task) {
+    char text[32];
+    snprintf(text, sizeof(text), "task %d", task);
+    todo_append(text);
+    expected[expected_count++] = task;
+}
+
+static void remove_at(int position) {
+    todo_remove(position);
+    memmove(expected + position - 1, expected + position, sizeof(int) * (expected_count - position));
+    expected_count--;
+}
+
+// Compares the list with the expected one, by position as todo remove sees it.
+static bool check(const char *step) {
+    bool same = todo.count == expected_count;
+
+    pthread_mutex_lock(&todo.lock);
+    for (int position = 1; same && position <= expected_count; position++) {
+        struct todo_record *r = &todo.records[todo_tree_find(position)];
+        char text[32], want[32];
+        snprintf(want, sizeof(want), "task %d", expected[position - 1]);
+        same = r->live && r->len == strlen(want) && pread(todo.fd, text, r->len, r->offset) == (ssize_t) r->len
+               && memcmp(text, want, r->len) == 0;
+    }
+    pthread_mutex_unlock(&todo.lock);
+    printf("%-40s %s\n", step, same ? "ok" : "WRONG");
+    return same;
+}
+
+static bool reload() {
+    todo_close();
+    todo.loaded = false;
+    return todo_load() == 0;
+}
+
+static bool compaction() {
+    char tmp_file[1100];
+    bool ok = true;
+
+    snprintf(todo_file, sizeof(todo_file), "/tmp/shellfyre_todo_check_%d.log", getpid());
+    snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", todo_file);
+    unlink(todo_file);
+    setenv("SHELLFYRE_TODO_FSYNC", "never", 1);
+    todo.loaded = false;
+    todo.next_id = 0;
+
+    // A directory in place of the new log makes the compaction fail.
+    mkdir(tmp_file, 0700);
+    for (int i = 0; i < 200; i++)
+        add(i);
+    for (int i = 0; i < 150; i++)
+        remove_at(1);
+    todo_close();
+    ok = check("after a failed compaction") && ok;
+    remove_at(10);
+    ok = check("remove after a failed compaction") && ok;
+    ok = reload() && check("reload") && ok;
+    remove_at(10);
+    ok = check("remove after a reload") && ok;
+    rmdir(tmp_file);
+
+    // Removes start a compaction, which runs while tasks come and go.
+    for (int i = 200; i < 400; i++)
+        add(i);
+    for (int i = 0; i < 150; i++)
+        remove_at(expected_count / 2 + 1);
+    for (int i = 400; i < 500; i++) {
+        add(i);
+        if (i % 3 == 0)
+            remove_at(1);
+    }
+    todo_close();
+    ok = check("adds and removes during a compaction") && ok;
+    ok = reload() && check("reload after the compaction") && ok;
+    remove_at(expected_count);
+    ok = check("remove after the compaction") && ok;
+
+    todo_close();
+    close(todo.fd);
+    todo.fd = -1;
+    unlink(todo_file);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    int n = argc > 1 ? atoi(argv[1]) : 100000;
+
+    run(n, "never");
+    run(n / 100 > 0 ? n / 100 : 1, "always");
+    return compaction() ? 0 : 1;
+}
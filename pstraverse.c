@@ -3,28 +3,111 @@
 #include <linux/init.h>
 #include <linux/cdev.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
 #include <linux/sched.h>
+#include <linux/cred.h>
+#include <linux/pid.h>
+#include <linux/rcupdate.h>
+#include <linux/rculist.h>
+#include <linux/ktime.h>
+#include <linux/sort.h>
+#include <linux/sched/mm.h>
+#include <linux/sched/signal.h>
+#include <linux/sched/task.h>
+#include <linux/hashtable.h>
+#include <linux/seqlock.h>
+#include <linux/tracepoint.h>
+#include <linux/workqueue.h>
+#include <linux/binfmts.h>
 #include <linux/kdev_t.h>
 #include <linux/uaccess.h>
 #include <linux/proc_fs.h>
 #include <linux/fs.h>
 #include <linux/device.h>
 
-#define SIZE 100
-static char *memoryBlock;
+#define SIZE 256
+#define OUT_SIZE (1 << 22)
 
 dev_t dev = 0;
 static struct class *dev_class;
 static struct cdev my_cdev;
 
 static char *option = "-d";
-static int pid = 1;
-
-static struct pid *pid_struct;
-static struct task_struct *task;
+static int pid = 0;
+static int max_depth = -1;
+static char *prefix = "";
+static char *match = "";
+static int uid = -1;
+static int limit = 0;
+static bool cache = false;
 
 module_param(option, charp, 0);
 module_param(pid, int, 0);
+module_param(max_depth, int, 0);
+module_param(prefix, charp, 0);
+module_param(match, charp, 0);
+module_param(uid, int, 0);
+module_param(limit, int, 0);
+module_param(cache, bool, 0);
+
+// Accessors used by the traversal code in pstraverse_core.h.
+static long task_uid_nr(struct task_struct *task) {
+    return from_kuid(&init_user_ns, task_uid(task));
+}
+
+static unsigned long task_rss(struct task_struct *task) {
+    unsigned long rss = 0;
+
+    task_lock(task);
+    if (task->mm)
+        rss = get_mm_rss(task->mm);
+    task_unlock(task);
+
+    return rss;
+}
+
+// Time of the threads that already exited is kept in the signal struct.
+static u64 task_cputime(struct task_struct *task) {
+    struct task_struct *thread;
+    u64 cputime = task->signal->utime + task->signal->stime;
+
+    for_each_thread(task, thread) {
+        cputime += thread->utime + thread->stime;
+    }
+
+    return cputime;
+}
+
+static unsigned int task_threads(struct task_struct *task) {
+    return get_nr_threads(task);
+}
+
+#include "pstraverse_core.h"
+
+// Output of the last request made through an open device file.
+struct ps_session {
+    char *out;
+    size_t out_len;
+};
+
+// Node of the process tree cache. Nodes are published with RCU and only freed
+// after a grace period, so readers can follow the links while forks and exits
+// update the tree.
+struct ps_cache_node {
+    struct hlist_node hash;
+    struct list_head sibling;
+    struct list_head children;
+    struct list_head orphan; // on cache_orphans while the children wait for a new parent
+    struct list_head move;   // on the list of cache_reparent() while unlinked
+    struct rcu_head rcu;
+    struct ps_cache_node *parent; // NULL while not linked below a parent
+    pid_t pid;
+    pid_t new_parent;
+    long uid;
+    bool dead;
+    bool moving;
+    char comm[TASK_COMM_LEN];
+};
 
 static int __init my_init(void);
 static void __exit my_exit(void);
@@ -32,9 +115,10 @@ static int my_open(struct inode *inode, struct file *file);
 static int my_release(struct inode *inode, struct file *file);
 static ssize_t my_read(struct file *filp, char __user *buf, size_t len, loff_t *off);
 static ssize_t my_write(struct file *filp, const char __user *buf, size_t len, loff_t *off);
-static void DFS(struct task_struct *task);
-static void BFS(struct task_struct *task);
-static void BFS_helper(struct task_struct *task);
+static int aggregate(pid_t root, struct ps_traversal *t);
+static int cache_enable(void);
+static void cache_disable(void);
+static int cache_query(pid_t root, const char *option, struct ps_traversal *t);
 
 static struct file_operations fops = {
     .owner = THIS_MODULE,
@@ -44,106 +128,723 @@ static struct file_operations fops = {
     .release = my_release,
 };
 
-static LIST_HEAD(queue);
 
-// Breadt First Search for process tree.
-static void BFS(struct task_struct *task){
-    struct task_struct *child;
-    struct list_head *list;
+// Computes the RSS, CPU time and thread count of every subtree below root in one
+// pass over the children/sibling links, then emits the heaviest subtrees.
+static int aggregate(pid_t root, struct ps_traversal *t) {
+    struct ps_agg_node *nodes;
+    struct task_struct *task;
+    unsigned int size, n = 0;
+
+    // Both passes walk the children lists, which change under tasklist_lock.
+    rcu_read_lock();
+    read_lock(&tasklist_lock);
+    task = pid_task(find_vpid(root), PIDTYPE_PID);
+    size = task ? count_tasks(task) : 0;
+    read_unlock(&tasklist_lock);
+    rcu_read_unlock();
+
+    if (size == 0) {
+        printk(KERN_INFO "PID does not exist.\n");
+        return -ESRCH;
+    }
 
-    BFS_helper(task);
+    // Leave room for the tasks forked between the two passes.
+    size += 64;
+    nodes = kvmalloc_array(size, sizeof(*nodes), GFP_KERNEL);
+    if (!nodes)
+        return -ENOMEM;
+
+    rcu_read_lock();
+    read_lock(&tasklist_lock);
+    task = pid_task(find_vpid(root), PIDTYPE_PID);
+    if (task)
+        n = fill_nodes(task, nodes, size);
+    read_unlock(&tasklist_lock);
+    if (task) {
+        fold_nodes(nodes, n);
+        emit_heaviest(nodes, n, t);
+    }
+    rcu_read_unlock();
+
+    kvfree(nodes);
+    return task ? 0 : -ESRCH;
+}
 
-    printk(KERN_INFO "Name: %s PID: %d\n", task->comm, task->pid);
-    list_for_each(list, &queue) {
-        child = list_entry(list, struct task_struct, sibling);
-        printk(KERN_INFO "Name: %s PID: %d\n", child->comm, child->pid);
+// The cache is a pid -> node index of the tree kept up to date from the
+// sched_process_fork/exec/exit tracepoints. Writers serialize on cache_lock and
+// readers retry their traversal if a writer ran in between, so a query always
+// returns a consistent snapshot without walking the task_struct lists.
+//
+// The children of an exiting process are moved to their new parent by a work
+// item (cache_reparent), the tree is only copied again from the task list
+// when an update was lost.
+static DEFINE_HASHTABLE(cache_index, 12);
+static DEFINE_SEQLOCK(cache_lock);
+static DEFINE_MUTEX(cache_mutex);
+static LIST_HEAD(cache_orphans);
+static bool cache_enabled;
+static bool cache_stale;
+static struct tracepoint *tp_fork, *tp_exec, *tp_exit;
+
+static void cache_reparent(struct work_struct *work);
+static DECLARE_DELAYED_WORK(cache_work, cache_reparent);
+
+static struct ps_cache_node *cache_lookup(pid_t pid) {
+    struct ps_cache_node *node;
+
+    hash_for_each_possible_rcu(cache_index, node, hash, pid) {
+        if (node->pid == pid)
+            return node;
     }
+
+    return NULL;
 }
 
-// Helper function for BFS.
-static void BFS_helper(struct task_struct *task){
-    struct task_struct *child;
-    struct list_head *list;
+// Adds a task below its parent node, in the given node or in a new one.
+// Called with cache_lock held.
+static struct ps_cache_node *cache_insert(struct task_struct *task, struct ps_cache_node *parent,
+                                          struct ps_cache_node *node) {
+    if (!node)
+        node = kzalloc(sizeof(*node), GFP_ATOMIC);
 
-    list_for_each(list, &task->children) {
-        child = list_entry(list, struct task_struct, sibling);
-        struct task_struct *curr = kmalloc(sizeof(struct task_struct), GFP_KERNEL);
-        curr->pid = child->pid;
-        strcpy(curr->comm, child->comm);
-        INIT_LIST_HEAD(&curr->sibling);
-        list_add_tail(&curr->sibling, &queue);
+    if (!node) {
+        cache_stale = true;
+        return NULL;
     }
 
-    list_for_each(list, &task->children) {
-        child = list_entry(list, struct task_struct, sibling);
-        BFS_helper(child);
+    node->pid = task->pid;
+    node->uid = task_uid_nr(task);
+    INIT_LIST_HEAD(&node->children);
+    INIT_LIST_HEAD(&node->orphan);
+    strscpy(node->comm, task->comm, sizeof(node->comm));
+
+    hash_add_rcu(cache_index, &node->hash, node->pid);
+    node->parent = parent;
+    if (parent)
+        list_add_tail_rcu(&node->sibling, &parent->children);
+    else
+        INIT_LIST_HEAD(&node->sibling);
+
+    return node;
+}
+
+// Frees a node that is not linked below a parent.
+static void cache_free(struct ps_cache_node *node) {
+    hash_del_rcu(&node->hash);
+    list_del_init(&node->orphan);
+    kfree_rcu(node, rcu);
+}
+
+static void cache_remove(struct ps_cache_node *node) {
+    list_del_rcu(&node->sibling);
+    cache_free(node);
+}
+
+static void cache_clear(void) {
+    struct ps_cache_node *node;
+    struct hlist_node *tmp;
+    int bucket;
+
+    hash_for_each_safe(cache_index, bucket, tmp, node, hash) {
+        hash_del_rcu(&node->hash);
+        kfree_rcu(node, rcu);
     }
+    INIT_LIST_HEAD(&cache_orphans);
 }
 
-// Depth First Search for process tree.
-static void DFS(struct task_struct *task) {
-    struct task_struct *child;
-    struct list_head *list;
+// Rebuilds the whole cache from the live task list. Called with cache_mutex
+// held. The nodes are allocated up front, so the copy runs in two flat passes
+// under the locks: one adds every process to the index, one links each to its
+// parent.
+static void cache_rebuild(void) {
+    struct ps_cache_node **nodes, *node, *parent;
+    struct task_struct *task;
+    unsigned int size = 1, n = 0, i;
+
+    cancel_delayed_work_sync(&cache_work);
+
+    rcu_read_lock();
+    for_each_process(task)
+        size++;
+    rcu_read_unlock();
+
+    // Leave room for the processes forked in between.
+    size += 64;
+    nodes = kvmalloc_array(size, sizeof(*nodes), GFP_KERNEL);
+    if (!nodes)
+        return;
+    for (i = 0; i < size; i++) {
+        nodes[i] = kzalloc(sizeof(**nodes), GFP_KERNEL);
+        if (!nodes[i])
+            break;
+    }
+    size = i;
+
+    rcu_read_lock();
+    write_seqlock(&cache_lock);
+    read_lock(&tasklist_lock);
+    cache_clear();
+    cache_stale = false;
+
+    cache_insert(&init_task, NULL, n < size ? nodes[n++] : NULL);
+    for_each_process(task)
+        cache_insert(task, NULL, n < size ? nodes[n++] : NULL);
+
+    for_each_process(task) {
+        node = cache_lookup(task->tgid);
+        parent = cache_lookup(rcu_dereference(task->real_parent)->tgid);
+        if (node && parent) {
+            node->parent = parent;
+            list_add_tail_rcu(&node->sibling, &parent->children);
+        }
+    }
+    read_unlock(&tasklist_lock);
+    write_sequnlock(&cache_lock);
+    rcu_read_unlock();
+
+    while (n < size)
+        kfree(nodes[n++]);
+    kvfree(nodes);
+}
 
-    printk(KERN_INFO "Name: %s PID: %d\n", task->comm, task->pid);
-    list_for_each(list, &task->children) {
-        child = list_entry(list, struct task_struct, sibling);
-        DFS(child);
+// Returns the tgid of the parent of a live process, 0 if it is gone.
+static pid_t cache_parent(pid_t pid) {
+    struct task_struct *task;
+    pid_t parent = 0;
+
+    rcu_read_lock();
+    task = pid_task(find_pid_ns(pid, &init_pid_ns), PIDTYPE_PID);
+    if (task && pid_alive(task))
+        parent = rcu_dereference(task->real_parent)->tgid;
+    rcu_read_unlock();
+
+    return parent;
+}
+
+// Moves the children of exited processes below the processes that adopted
+// them. The kernel reparents them after the exit tracepoint, so this runs as
+// work and comes back until every child has its new parent. A node is
+// unlinked first and only added to its new list after a grace period: a
+// reader standing on it would otherwise follow it into the new list and never
+// get back to the head of the list it started on.
+static void cache_reparent(struct work_struct *work) {
+    struct ps_cache_node *orphan, *child, *parent, *tmp, *next;
+    LIST_HEAD(moving);
+    bool again = false;
+
+    // cache_rebuild() and cache_disable() cancel the work with the mutex held.
+    if (!mutex_trylock(&cache_mutex)) {
+        schedule_delayed_work(&cache_work, 1);
+        return;
+    }
+    if (!cache_enabled)
+        goto out;
+
+    rcu_read_lock();
+    write_seqlock(&cache_lock);
+    list_for_each_entry_safe(orphan, tmp, &cache_orphans, orphan) {
+        list_for_each_entry_safe(child, next, &orphan->children, sibling) {
+            // Exited itself and an orphan in turn, or not reparented yet.
+            child->new_parent = child->dead ? 0 : cache_parent(child->pid);
+            if (child->new_parent == 0 || child->new_parent == orphan->pid) {
+                again = true;
+                continue;
+            }
+            list_del_rcu(&child->sibling);
+            child->moving = true;
+            list_add_tail(&child->move, &moving);
+        }
+        if (list_empty(&orphan->children))
+            cache_remove(orphan);
+    }
+    write_sequnlock(&cache_lock);
+    rcu_read_unlock();
+
+    if (list_empty(&moving))
+        goto out;
+    synchronize_rcu();
+
+    rcu_read_lock();
+    write_seqlock(&cache_lock);
+    list_for_each_entry_safe(child, tmp, &moving, move) {
+        list_del(&child->move);
+        child->moving = false;
+        parent = cache_lookup(child->new_parent);
+
+        if (child->dead && list_empty(&child->children)) {
+            cache_free(child);
+        } else if (parent) {
+            WRITE_ONCE(child->parent, parent);
+            list_add_tail_rcu(&child->sibling, &parent->children);
+        } else {
+            // The new parent exited in the meantime.
+            WRITE_ONCE(child->parent, NULL);
+            INIT_LIST_HEAD(&child->sibling);
+            cache_stale = true;
+        }
+    }
+    write_sequnlock(&cache_lock);
+    rcu_read_unlock();
+
+out:
+    mutex_unlock(&cache_mutex);
+    if (again)
+        schedule_delayed_work(&cache_work, 1);
+}
+
+static void probe_fork(void *data, struct task_struct *parent, struct task_struct *child) {
+    struct ps_cache_node *node;
+
+    // Threads are not linked into the children lists.
+    if (!thread_group_leader(child))
+        return;
+
+    rcu_read_lock();
+    write_seqlock(&cache_lock);
+    // A rebuild that ran before this probe got the lock has the child already.
+    if (!cache_lookup(child->tgid)) {
+        node = cache_lookup(rcu_dereference(child->real_parent)->tgid);
+        if (node)
+            cache_insert(child, node, NULL);
+        else
+            cache_stale = true;
+    }
+    write_sequnlock(&cache_lock);
+    rcu_read_unlock();
+}
+
+static void probe_exec(void *data, struct task_struct *task, pid_t old_pid, struct linux_binprm *bprm) {
+    struct ps_cache_node *node;
+
+    rcu_read_lock();
+    write_seqlock(&cache_lock);
+    node = cache_lookup(task->tgid);
+    if (node)
+        strscpy(node->comm, task->comm, sizeof(node->comm));
+    write_sequnlock(&cache_lock);
+    rcu_read_unlock();
+}
+
+static void probe_exit(void *data, struct task_struct *task) {
+    struct ps_cache_node *node;
+
+    // The process leaves the tree when its last thread exits. Threads that
+    // exit together can all see no live thread left, so only the first of
+    // them to get here handles the node.
+    if (atomic_read(&task->signal->live) != 0)
+        return;
+
+    rcu_read_lock();
+    write_seqlock(&cache_lock);
+    node = cache_lookup(task->tgid);
+    if (node && node->dead)
+        node = NULL; // already on the orphan list or being moved
+    if (node && !list_empty(&node->children)) {
+        // The kernel reparents the children right after this point, the work
+        // moves them once their new parent is known.
+        node->dead = true;
+        list_add_tail(&node->orphan, &cache_orphans);
+        schedule_delayed_work(&cache_work, 0);
+    } else if (node && node->moving) {
+        node->dead = true; // freed by cache_reparent()
+    } else if (node) {
+        cache_remove(node);
     }
+    write_sequnlock(&cache_lock);
+    rcu_read_unlock();
 }
 
-// Space allocation for device file.
+static void find_tracepoint(struct tracepoint *tp, void *priv) {
+    if (strcmp(tp->name, "sched_process_fork") == 0)
+        tp_fork = tp;
+    else if (strcmp(tp->name, "sched_process_exec") == 0)
+        tp_exec = tp;
+    else if (strcmp(tp->name, "sched_process_exit") == 0)
+        tp_exit = tp;
+}
+
+// Registers the tracepoint probes and fills the cache. Probes are registered
+// first, so no fork is missed while the live tree is copied.
+static int cache_enable(void) {
+    int ret = 0;
+
+    mutex_lock(&cache_mutex);
+    if (cache_enabled)
+        goto out;
+
+    for_each_kernel_tracepoint(find_tracepoint, NULL);
+    if (!tp_fork || !tp_exec || !tp_exit) {
+        printk(KERN_INFO "Cannot find the sched tracepoints...\n");
+        ret = -ENOENT;
+        goto out;
+    }
+
+    ret = tracepoint_probe_register(tp_fork, probe_fork, NULL);
+    if (ret)
+        goto out;
+    ret = tracepoint_probe_register(tp_exec, probe_exec, NULL);
+    if (ret)
+        goto r_fork;
+    ret = tracepoint_probe_register(tp_exit, probe_exit, NULL);
+    if (ret)
+        goto r_exec;
+
+    cache_rebuild();
+    cache_enabled = true;
+    printk(KERN_INFO "pstraverse: process tree cache enabled\n");
+    goto out;
+
+r_exec:
+    tracepoint_probe_unregister(tp_exec, probe_exec, NULL);
+r_fork:
+    tracepoint_probe_unregister(tp_fork, probe_fork, NULL);
+out:
+    mutex_unlock(&cache_mutex);
+    return ret;
+}
+
+static void cache_disable(void) {
+    mutex_lock(&cache_mutex);
+    if (cache_enabled) {
+        tracepoint_probe_unregister(tp_fork, probe_fork, NULL);
+        tracepoint_probe_unregister(tp_exec, probe_exec, NULL);
+        tracepoint_probe_unregister(tp_exit, probe_exit, NULL);
+        tracepoint_synchronize_unregister();
+        cache_enabled = false;
+        cancel_delayed_work_sync(&cache_work);
+
+        write_seqlock(&cache_lock);
+        cache_clear();
+        cache_stale = false;
+        write_sequnlock(&cache_lock);
+        synchronize_rcu();
+
+        printk(KERN_INFO "pstraverse: process tree cache disabled\n");
+    }
+    mutex_unlock(&cache_mutex);
+}
+
+// Returns the node after the given one in a pre-order walk of the cached
+// subtree, going back up through the parent pointers like ps_next() does
+// through real_parent. A node only gets a new parent after a grace period, so
+// the parent of a node reached in this walk is the list it was reached from.
+static struct ps_cache_node *cache_next(struct ps_cache_node *node, int *depth, bool descend) {
+    struct ps_cache_node *next, *parent;
+
+    if (descend) {
+        next = list_first_or_null_rcu(&node->children, struct ps_cache_node, sibling);
+        if (next) {
+            (*depth)++;
+            return next;
+        }
+    }
+
+    while (*depth > 0) {
+        parent = READ_ONCE(node->parent);
+        if (!parent)
+            return NULL;
+
+        next = list_next_or_null_rcu(&parent->children, &node->sibling, struct ps_cache_node, sibling);
+        if (next)
+            return next;
+
+        node = parent;
+        (*depth)--;
+    }
+
+    return NULL;
+}
+
+// Depth First Search over the cache.
+static void cache_DFS(struct ps_cache_node *node, struct ps_traversal *t) {
+    int depth = 0;
+
+    while (node && !ps_done(t)) {
+        if (!node->dead)
+            ps_visit(t, node->comm, node->pid, node->uid);
+        node = cache_next(node, &depth, !ps_prune(t, depth));
+    }
+}
+
+// Breadth First Search over the cache.
+static void cache_BFS(struct ps_cache_node *root, struct ps_traversal *t) {
+    struct ps_cache_queue {
+        struct list_head list;
+        struct ps_cache_node *node;
+        int depth;
+    } *entry, *next;
+    struct ps_cache_node *child;
+    LIST_HEAD(queue);
+
+    entry = kmalloc(sizeof(*entry), GFP_ATOMIC);
+    if (!entry)
+        return;
+    entry->node = root;
+    entry->depth = 0;
+    list_add_tail(&entry->list, &queue);
+
+    while (!list_empty(&queue) && !ps_done(t)) {
+        entry = list_first_entry(&queue, struct ps_cache_queue, list);
+        list_del(&entry->list);
+
+        if (!entry->node->dead)
+            ps_visit(t, entry->node->comm, entry->node->pid, entry->node->uid);
+
+        if (!ps_prune(t, entry->depth)) {
+            list_for_each_entry_rcu(child, &entry->node->children, sibling) {
+                next = kmalloc(sizeof(*next), GFP_ATOMIC);
+                if (!next) {
+                    t->truncated = true;
+                    break;
+                }
+                next->node = child;
+                next->depth = entry->depth + 1;
+                list_add_tail(&next->list, &queue);
+            }
+        }
+
+        kfree(entry);
+    }
+
+    list_for_each_entry_safe(entry, next, &queue, list) {
+        list_del(&entry->list);
+        kfree(entry);
+    }
+}
+
+// Runs a traversal on a consistent snapshot of the cache. After a few
+// concurrent updates the reader takes the lock, which holds off forks and
+// exits for the duration of the walk. Returns -ENOENT if the cache was
+// turned off before the walk.
+static int cache_query(pid_t root, const char *option, struct ps_traversal *t) {
+    struct ps_cache_node *node;
+    int seq = 0;
+    int tries = 0;
+    int ret;
+
+    // Updates were lost, copy the tree again unless the cache is being turned off.
+    if (READ_ONCE(cache_stale)) {
+        mutex_lock(&cache_mutex);
+        if (cache_enabled && cache_stale)
+            cache_rebuild();
+        mutex_unlock(&cache_mutex);
+    }
+
+    rcu_read_lock();
+again:
+    read_seqbegin_or_lock(&cache_lock, &seq);
+
+    t->len = 0;
+    t->visited = 0;
+    t->matched = 0;
+    t->truncated = false;
+    ret = 0;
+
+    node = cache_lookup(root);
+    if (!READ_ONCE(cache_enabled)) {
+        ret = -ENOENT;
+    } else if (!node) {
+        ret = -ESRCH;
+    } else if (strcmp(option, "-d") == 0) {
+        cache_DFS(node, t);
+    } else if (strcmp(option, "-b") == 0) {
+        cache_BFS(node, t);
+    } else {
+        ret = -EINVAL;
+    }
+
+    if (need_seqretry(&cache_lock, seq)) {
+        // An odd sequence makes the next attempt take the lock.
+        seq = ++tries < 3 ? 0 : 1;
+        goto again;
+    }
+    done_seqretry(&cache_lock, seq);
+    rcu_read_unlock();
+
+    if (ret == -ESRCH)
+        printk(KERN_INFO "PID does not exist.\n");
+
+    return ret;
+}
+
+// Parses a "key=value" traversal option into the filter.
+static int ps_parse_filter(struct ps_filter *filter, char *token) {
+    char *value = strchr(token, '=');
+    long number;
+
+    if (!value)
+        return -EINVAL;
+    *value++ = '\0';
+
+    if (strcmp(token, "prefix") == 0) {
+        strscpy(filter->prefix, value, sizeof(filter->prefix));
+        return 0;
+    }
+    if (strcmp(token, "match") == 0) {
+        strscpy(filter->match, value, sizeof(filter->match));
+        return 0;
+    }
+
+    if (kstrtol(value, 10, &number) != 0)
+        return -EINVAL;
+
+    if (strcmp(token, "depth") == 0) {
+        filter->max_depth = number;
+    } else if (strcmp(token, "uid") == 0) {
+        filter->uid = number;
+    } else if (strcmp(token, "max") == 0) {
+        filter->max_records = number;
+    } else {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+// Runs the traversal selected by option starting from the given PID.
+static int ps_run(struct ps_traversal *t, pid_t root, const char *option) {
+    struct task_struct *task;
+    u64 start = ktime_get_ns();
+    bool cached = false;
+    int ret = 0;
+
+    // Aggregation allocates its index, so it takes the RCU read lock itself.
+    if (strcmp(option, "-a") == 0) {
+        ret = t->buf ? aggregate(root, t) : -EINVAL;
+        goto out;
+    }
+
+    if (cache_enabled && t->buf) {
+        ret = cache_query(root, option, t);
+        cached = ret != -ENOENT;
+        if (cached)
+            goto out;
+        ret = 0;
+    }
+
+    // The children and sibling lists are not RCU lists, they change under
+    // tasklist_lock, so the walk holds it for reading.
+    rcu_read_lock();
+    read_lock(&tasklist_lock);
+    task = pid_task(find_vpid(root), PIDTYPE_PID);
+
+    if (task == NULL) {
+        printk(KERN_INFO "PID does not exist.\n");
+        ret = -ESRCH;
+    } else if (strcmp(option, "-d") == 0) {
+        DFS(task, t);
+    } else if (strcmp(option, "-b") == 0) {
+        BFS(task, t);
+    } else {
+        ret = -EINVAL;
+    }
+    read_unlock(&tasklist_lock);
+    rcu_read_unlock();
+
+out:
+    printk(KERN_INFO "pstraverse: visited %u, matched %u, copied %zu bytes in %llu ns%s%s\n",
+           t->visited, t->matched, t->len, ktime_get_ns() - start,
+           cached ? " (cache)" : "", t->truncated ? " (truncated)" : "");
+
+    return ret;
+}
+
+// Space allocation for the session of the device file.
 static int my_open(struct inode *inode, struct file *file) {
-    memoryBlock = kmalloc(SIZE, GFP_KERNEL);
+    struct ps_session *session = kzalloc(sizeof(*session), GFP_KERNEL);
+
+    if (!session)
+        return -ENOMEM;
+
+    file->private_data = session;
     return 0;
 }
 
 // Freeing allocated space.
 static int my_release(struct inode *inode, struct file *file) {
-    kfree(memoryBlock);
+    struct ps_session *session = file->private_data;
+
+    kvfree(session->out);
+    kfree(session);
     return 0;
 }
 
-// Copy from kernel space to user space.
+// Copy the records of the last request from kernel space to user space.
 static ssize_t my_read(struct file *filp, char __user *buf, size_t len, loff_t *off) {
-    if (copy_to_user(buf, memoryBlock, strlen(memoryBlock)) != 0) {
-        printk(KERN_INFO "Copy from kernel space to user space is failed.\n");
-    }
-    return len;
+    struct ps_session *session = filp->private_data;
+
+    if (!session->out)
+        return 0;
+
+    return simple_read_from_buffer(buf, len, off, session->out, session->out_len);
 }
 
-// Copy data from user space to kernel space and call the proper function.
+// Copy the request from user space to kernel space and call the proper function.
+// The request has the form "<pid> <-d|-b|-a> [depth=N] [prefix=S] [match=S] [uid=N] [max=N]"
+// or "cache <on|off>" to switch the process tree cache.
 static ssize_t my_write(struct file *filp, const char __user *buf, size_t len, loff_t *off) {
-    if (copy_from_user(memoryBlock, buf, len) != 0) {
+    struct ps_session *session = filp->private_data;
+    struct ps_traversal t;
+    char request[SIZE];
+    char *cursor = request;
+    char *token;
+    char *data[2] = {NULL, NULL};
+    int count = 0;
+    long pid2;
+    int ret;
+
+    if (len >= SIZE)
+        return -EINVAL;
+
+    if (copy_from_user(request, buf, len) != 0) {
         printk(KERN_INFO "Copy from user space to kernel space is failed.\n");
+        return -EFAULT;
     }
+    request[len] = '\0';
 
-    char data[2][10];
-    char *token;
+    memset(&t, 0, sizeof(t));
+    ps_init_filter(&t.filter);
 
-    int count = 0;
-    while ((token = strsep(&memoryBlock, " ")) != NULL) {
-        strcpy(data[count], token);
-        count++;
-    }
+    while ((token = strsep(&cursor, " \n")) != NULL) {
+        if (*token == '\0')
+            continue;
 
-    long pid2;
-    if (kstrtol(data[0], 10, &pid2) == 0) {
-        pid_struct = find_get_pid(pid2);
-        task = pid_task(pid_struct, PIDTYPE_PID);
+        if (count < 2) {
+            data[count++] = token;
+        } else if (ps_parse_filter(&t.filter, token) != 0) {
+            return -EINVAL;
+        }
+    }
 
-        if (task == NULL) {
-            printk(KERN_INFO "PID does not exist.\n");
+    if (count == 2 && strcmp(data[0], "cache") == 0) {
+        if (strcmp(data[1], "on") == 0) {
+            ret = cache_enable();
+        } else if (strcmp(data[1], "off") == 0) {
+            cache_disable();
+            ret = 0;
         } else {
-            if(strcmp(data[1], "-d") == 0) {
-                DFS(task);
-            } else if (strcmp(data[1], "-b") == 0) {
-                BFS(task);
-            }
+            ret = -EINVAL;
         }
-    } 
+        return ret < 0 ? ret : len;
+    }
+
+    if (count < 2 || kstrtol(data[0], 10, &pid2) != 0)
+        return -EINVAL;
 
-    return len;
+    if (!session->out) {
+        session->out = kvmalloc(OUT_SIZE, GFP_KERNEL);
+        if (!session->out)
+            return -ENOMEM;
+    }
+
+    t.buf = session->out;
+    t.size = OUT_SIZE;
+    ret = ps_run(&t, pid2, data[1]);
+    session->out_len = t.len;
+    *off = 0;
+
+    return ret < 0 ? ret : len;
 }
 
 // Initilization function that creates the device file.
@@ -174,17 +875,22 @@ static int __init my_init(void) {
 
     printk(KERN_INFO "Device driver insert...done properly...");
 
-    pid_struct = find_get_pid(pid);
-    task = pid_task(pid_struct, PIDTYPE_PID);
+    if (cache)
+        cache_enable();
 
-    if (task == NULL) {
-        printk(KERN_INFO "PID does not exist.\n");
-    } else {
-        if(strcmp(option, "-d") == 0) {
-            DFS(task);
-        } else if (strcmp(option, "-b") == 0) {
-            BFS(task);
-        }
+    // A traversal requested through module parameters is written to the kernel log.
+    if (pid > 0) {
+        struct ps_traversal t;
+
+        memset(&t, 0, sizeof(t));
+        ps_init_filter(&t.filter);
+        t.filter.max_depth = max_depth;
+        t.filter.uid = uid;
+        t.filter.max_records = limit;
+        strscpy(t.filter.prefix, prefix, sizeof(t.filter.prefix));
+        strscpy(t.filter.match, match, sizeof(t.filter.match));
+
+        ps_run(&t, pid, option);
     }
 
     return 0;
@@ -199,6 +905,7 @@ r_class:
 
 // Exit function that removes the device file.
 static void __exit my_exit(void) {
+    cache_disable();
     device_destroy(dev_class, dev);
     class_destroy(dev_class);
     cdev_del(&my_cdev);
@@ -0,0 +1,266 @@
+// Traversal algorithms of pstraverse.
+//
+// This file is included by the kernel module and by the user-space benchmark in
+// bench/, which provides a mock of the few kernel definitions used here. The
+// includer has to define task_uid_nr(), task_rss(), task_cputime() and
+// task_threads() before including it.
+
+#ifndef PSTRAVERSE_CORE_H
+#define PSTRAVERSE_CORE_H
+
+// Filters evaluated during the traversal, so only matching records leave the module.
+struct ps_filter {
+    int max_depth;              // -1 means no limit
+    char prefix[TASK_COMM_LEN]; // name has to start with it, empty means any name
+    char match[TASK_COMM_LEN];  // name has to contain it, empty means any name
+    long uid;                   // -1 means any user
+    unsigned int max_records;   // 0 means no limit
+};
+
+// State of a single traversal. If buf is NULL the records go to the kernel log.
+struct ps_traversal {
+    struct ps_filter filter;
+    char *buf;
+    size_t len;
+    size_t size;
+    unsigned int visited;
+    unsigned int matched;
+    bool truncated;
+};
+
+// Per-task entry of the aggregation pass. The totals cover the whole subtree.
+struct ps_agg_node {
+    struct task_struct *task;
+    int parent;
+    unsigned long rss;          // in pages
+    u64 cputime;                // utime + stime in ns
+    unsigned int threads;
+    unsigned int tasks;
+};
+
+// Queue entry for BFS.
+struct ps_queue_node {
+    struct list_head list;
+    struct task_struct *task;
+    int depth;
+};
+
+static void ps_init_filter(struct ps_filter *filter) {
+    memset(filter, 0, sizeof(*filter));
+    filter->max_depth = -1;
+    filter->uid = -1;
+}
+
+// Returns true when no more records should be produced.
+static bool ps_done(struct ps_traversal *t) {
+    return t->truncated || (t->filter.max_records && t->matched >= t->filter.max_records);
+}
+
+// Returns true if the subtree below a task at the given depth should be skipped.
+static bool ps_prune(struct ps_traversal *t, int depth) {
+    return t->filter.max_depth >= 0 && depth >= t->filter.max_depth;
+}
+
+// Checks the name and user filters of a task.
+static bool ps_match(struct ps_filter *filter, const char *comm, long uid) {
+    if (filter->uid >= 0 && uid != filter->uid)
+        return false;
+
+    if (filter->prefix[0] != '\0' && strncmp(comm, filter->prefix, strlen(filter->prefix)) != 0)
+        return false;
+
+    return filter->match[0] == '\0' || strstr(comm, filter->match) != NULL;
+}
+
+// Emits the record of a task if it passes the filters.
+static void ps_visit(struct ps_traversal *t, const char *comm, pid_t pid, long uid) {
+    int n;
+
+    t->visited++;
+    if (!ps_match(&t->filter, comm, uid))
+        return;
+
+    t->matched++;
+    if (t->buf == NULL) {
+        printk(KERN_INFO "Name: %s PID: %d\n", comm, pid);
+        return;
+    }
+
+    n = snprintf(t->buf + t->len, t->size - t->len, "Name: %s PID: %d\n", comm, pid);
+    if (n >= t->size - t->len) {
+        t->truncated = true;
+        return;
+    }
+    t->len += n;
+}
+
+static void ps_visit_task(struct task_struct *task, struct ps_traversal *t) {
+    ps_visit(t, task->comm, task->pid, task_uid_nr(task));
+}
+
+// Returns the task after the given one in a pre-order walk of the subtree whose
+// root is at depth 0, or NULL at the end of the walk. The walk goes down through
+// the children lists and back up through real_parent, so it needs no stack even
+// for very deep trees. The children of task are skipped if descend is false.
+static struct task_struct *ps_next(struct task_struct *task, int *depth, bool descend) {
+    if (descend && !list_empty(&task->children)) {
+        (*depth)++;
+        return list_first_entry(&task->children, struct task_struct, sibling);
+    }
+
+    while (*depth > 0) {
+        if (!list_is_last(&task->sibling, &task->real_parent->children))
+            return list_next_entry(task, sibling);
+
+        task = task->real_parent;
+        (*depth)--;
+    }
+
+    return NULL;
+}
+
+// Breadth First Search for process tree.
+static void BFS(struct task_struct *task, struct ps_traversal *t) {
+    LIST_HEAD(queue);
+    struct ps_queue_node *node, *next;
+    struct task_struct *child;
+
+    node = kmalloc(sizeof(*node), GFP_ATOMIC);
+    if (!node)
+        return;
+    node->task = task;
+    node->depth = 0;
+    list_add_tail(&node->list, &queue);
+
+    while (!list_empty(&queue) && !ps_done(t)) {
+        node = list_first_entry(&queue, struct ps_queue_node, list);
+        list_del(&node->list);
+
+        ps_visit_task(node->task, t);
+
+        if (!ps_prune(t, node->depth)) {
+            list_for_each_entry(child, &node->task->children, sibling) {
+                next = kmalloc(sizeof(*next), GFP_ATOMIC);
+                if (!next) {
+                    t->truncated = true;
+                    break;
+                }
+                next->task = child;
+                next->depth = node->depth + 1;
+                list_add_tail(&next->list, &queue);
+            }
+        }
+
+        kfree(node);
+    }
+
+    list_for_each_entry_safe(node, next, &queue, list) {
+        list_del(&node->list);
+        kfree(node);
+    }
+}
+
+// Depth First Search for process tree.
+static void DFS(struct task_struct *task, struct ps_traversal *t) {
+    int depth = 0;
+
+    while (task && !ps_done(t)) {
+        ps_visit_task(task, t);
+        task = ps_next(task, &depth, !ps_prune(t, depth));
+    }
+}
+
+// Counts the tasks in a subtree.
+static unsigned int count_tasks(struct task_struct *task) {
+    unsigned int count = 0;
+    int depth = 0;
+
+    for (; task; task = ps_next(task, &depth, true))
+        count++;
+
+    return count;
+}
+
+// Fills the aggregation array in pre-order, so a parent always comes before its
+// children, and returns the number of entries. The parent of an entry is the
+// ancestor of the previous entry one level above it.
+static unsigned int fill_nodes(struct task_struct *task, struct ps_agg_node *nodes, unsigned int size) {
+    unsigned int n = 0;
+    int depth = 0, prev_depth = 0;
+    int parent;
+
+    for (; task && n < size; task = ps_next(task, &depth, true)) {
+        struct ps_agg_node *node = &nodes[n];
+
+        parent = n > 0 ? (int)n - 1 : -1;
+        for (; prev_depth >= depth && parent >= 0; prev_depth--)
+            parent = nodes[parent].parent;
+        prev_depth = depth;
+
+        node->task = task;
+        node->parent = parent;
+        node->tasks = 1;
+        node->threads = task_threads(task);
+        node->rss = task_rss(task);
+        node->cputime = task_cputime(task);
+        n++;
+    }
+
+    return n;
+}
+
+// Walking the pre-order array backwards visits every child before its parent,
+// so one pass adds each subtree into its root.
+static void fold_nodes(struct ps_agg_node *nodes, unsigned int n) {
+    unsigned int i;
+
+    for (i = n > 0 ? n - 1 : 0; i > 0; i--) {
+        struct ps_agg_node *parent = &nodes[nodes[i].parent];
+
+        parent->rss += nodes[i].rss;
+        parent->cputime += nodes[i].cputime;
+        parent->threads += nodes[i].threads;
+        parent->tasks += nodes[i].tasks;
+    }
+}
+
+// Heaviest subtree (by RSS, then CPU time) first.
+static int compare_nodes(const void *a, const void *b) {
+    const struct ps_agg_node *x = a, *y = b;
+
+    if (x->rss != y->rss)
+        return x->rss < y->rss ? 1 : -1;
+    if (x->cputime != y->cputime)
+        return x->cputime < y->cputime ? 1 : -1;
+    return x->task->pid - y->task->pid;
+}
+
+// Sorts the folded array and emits the heaviest subtrees that pass the filters.
+static void emit_heaviest(struct ps_agg_node *nodes, unsigned int n, struct ps_traversal *t) {
+    unsigned int i, top;
+
+    sort(nodes, n, sizeof(*nodes), compare_nodes, NULL);
+
+    top = t->filter.max_records ? t->filter.max_records : 10;
+    for (i = 0; i < n && t->matched < top && !t->truncated; i++) {
+        struct ps_agg_node *node = &nodes[i];
+        int len;
+
+        t->visited++;
+        if (!ps_match(&t->filter, node->task->comm, task_uid_nr(node->task)))
+            continue;
+
+        t->matched++;
+        len = snprintf(t->buf + t->len, t->size - t->len,
+                       "Name: %s PID: %d RSS: %lu kB CPU: %llu ms Threads: %u Tasks: %u\n",
+                       node->task->comm, node->task->pid, node->rss << (PAGE_SHIFT - 10),
+                       (unsigned long long)(node->cputime / NSEC_PER_MSEC), node->threads, node->tasks);
+        if (len >= t->size - t->len) {
+            t->truncated = true;
+            break;
+        }
+        t->len += len;
+    }
+}
+
+#endif
@@ -12,14 +12,301 @@
 #include <dirent.h> 
 #include <ctype.h>
 #include <fcntl.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <time.h>
+#include <signal.h>
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/pidfd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <elf.h>
 
 // Kemal Bora Bayraktar 75618
 
 const char *sysname = "shellfyre";
 char cdh_file[1024];
 char todo_file[1024];
+char history_file[1024];
 int module_inserted = 0;
 
+#define FILE_LIST_SIZE 1024 // most matches filesearch shows
+#define FILESEARCH_QUEUE_DEPTH 64 // io_uring requests in flight
+static char no_file[] = ""; // an empty slot of a file list, it is not allocated
+int last_status = 0; // exit status of the last command, $? of other shells
+
+// Allocation profiling, built with -DSHELLFYRE_ALLOC_PROFILE. malloc() and
+// friends in this file are macros for wrappers that put a header in front of
+// every block, naming the call site, and count allocations, bytes, live and
+// peak bytes per call site and per command. `memstats` prints the counts.
+// Memory allocated inside the C library (stdio, opendir()) is not counted,
+// and blocks it returns, such as a getline() buffer, are freed by the wrappers
+// as they are. Without the flag the macros and the wrappers do not exist.
+#ifdef SHELLFYRE_ALLOC_PROFILE
+#define ALLOC_SITES 512
+#define ALLOC_COMMANDS 16
+#define ALLOC_MAGIC 0x5368656cu // the high half of a glibc chunk size is 0
+
+// The header keeps the alignment of malloc(), 16 bytes.
+struct alloc_header
+{
+    size_t size;
+    unsigned int site;
+    unsigned int magic;
+};
+
+struct alloc_site
+{
+    const char *function;
+    int line;
+    unsigned long allocations;
+    unsigned long bytes;
+    unsigned long live_blocks;
+    size_t live_bytes;
+};
+
+struct alloc_command
+{
+    char name[32];
+    unsigned long allocations;
+    unsigned long bytes;
+    size_t peak;     // most bytes live at once above the live bytes at the start
+    long retained;   // live bytes at the end minus the live bytes at the start
+};
+
+struct alloc_profile
+{
+    pthread_mutex_t lock;
+    struct alloc_site sites[ALLOC_SITES];
+    unsigned long allocations;
+    unsigned long bytes;
+    size_t live;
+    size_t peak;
+    // the command running in the main loop
+    unsigned long command_allocations, command_bytes;
+    size_t command_live, command_peak;
+    struct alloc_command commands[ALLOC_COMMANDS]; // the last commands, in a ring
+    int command_count;
+};
+
+static struct alloc_profile alloc_profile = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// Finds or adds the site, with the lock held. Sites past the table share the
+// last slot.
+static unsigned int alloc_site(const char *function, int line)
+{
+    unsigned int slot = (unsigned int)line % (ALLOC_SITES - 1);
+    for (int probe = 0; probe < ALLOC_SITES - 1; probe++, slot = (slot + 1) % (ALLOC_SITES - 1))
+    {
+        struct alloc_site *site = &alloc_profile.sites[slot];
+        if (site->line == line && site->function == function)
+            return slot;
+        if (site->function == NULL)
+        {
+            site->function = function;
+            site->line = line;
+            return slot;
+        }
+    }
+    return ALLOC_SITES - 1;
+}
+
+static void *alloc_track(struct alloc_header *header, size_t size, const char *function, int line)
+{
+    if (header == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&alloc_profile.lock);
+    header->size = size;
+    header->site = alloc_site(function, line);
+    header->magic = ALLOC_MAGIC;
+
+    struct alloc_site *site = &alloc_profile.sites[header->site];
+    site->allocations++;
+    site->bytes += size;
+    site->live_blocks++;
+    site->live_bytes += size;
+    alloc_profile.allocations++;
+    alloc_profile.bytes += size;
+    alloc_profile.command_allocations++;
+    alloc_profile.command_bytes += size;
+    alloc_profile.live += size;
+    if (alloc_profile.live > alloc_profile.peak)
+        alloc_profile.peak = alloc_profile.live;
+    if (alloc_profile.live > alloc_profile.command_peak)
+        alloc_profile.command_peak = alloc_profile.live;
+    pthread_mutex_unlock(&alloc_profile.lock);
+    return header + 1;
+}
+
+// Takes a block of the given size and site out of the live counts.
+static void alloc_release(size_t size, unsigned int site_index)
+{
+    pthread_mutex_lock(&alloc_profile.lock);
+    struct alloc_site *site = &alloc_profile.sites[site_index];
+    site->live_blocks--;
+    site->live_bytes -= size;
+    alloc_profile.live -= size;
+    pthread_mutex_unlock(&alloc_profile.lock);
+}
+
+// Returns the header of a block of the wrappers, or NULL for a block of the
+// C library.
+static struct alloc_header *alloc_header(void *ptr)
+{
+    struct alloc_header *header = (struct alloc_header *)ptr - 1;
+    return ptr == NULL || header->magic != ALLOC_MAGIC ? NULL : header;
+}
+
+// Returns the header of a block about to be freed, after taking it out of the
+// live counts.
+static struct alloc_header *alloc_untrack(void *ptr)
+{
+    struct alloc_header *header = alloc_header(ptr);
+    if (header == NULL)
+        return NULL;
+
+    alloc_release(header->size, header->site);
+    header->magic = 0;
+    return header;
+}
+
+static void *alloc_malloc(size_t size, const char *function, int line)
+{
+    return alloc_track(malloc(sizeof(struct alloc_header) + size), size, function, line);
+}
+
+static void *alloc_calloc(size_t count, size_t size, const char *function, int line)
+{
+    if (size && count > (SIZE_MAX - sizeof(struct alloc_header)) / size)
+        return NULL;
+    return alloc_track(calloc(1, sizeof(struct alloc_header) + count * size), count * size, function, line);
+}
+
+static void *alloc_realloc(void *ptr, size_t size, const char *function, int line)
+{
+    if (ptr == NULL)
+        return alloc_malloc(size, function, line);
+
+    struct alloc_header *header = alloc_header(ptr);
+    if (header == NULL)
+        return realloc(ptr, size);
+    if (size > SIZE_MAX - sizeof(struct alloc_header))
+        return NULL;
+
+    // The counts change only once the block is replaced, a failed realloc
+    // leaves the old one as it was.
+    size_t old_size = header->size;
+    unsigned int old_site = header->site;
+    struct alloc_header *moved = realloc(header, sizeof(struct alloc_header) + size);
+    if (moved == NULL)
+        return NULL;
+    alloc_release(old_size, old_site);
+    return alloc_track(moved, size, function, line);
+}
+
+static char *alloc_strdup(const char *text, const char *function, int line)
+{
+    size_t size = strlen(text) + 1;
+    char *copy = alloc_malloc(size, function, line);
+    if (copy)
+        memcpy(copy, text, size);
+    return copy;
+}
+
+static void alloc_free(void *ptr)
+{
+    struct alloc_header *header = alloc_untrack(ptr);
+    free(header ? (void *)header : ptr);
+}
+
+#define malloc(size) alloc_malloc(size, __func__, __LINE__)
+#define calloc(count, size) alloc_calloc(count, size, __func__, __LINE__)
+#define realloc(ptr, size) alloc_realloc(ptr, size, __func__, __LINE__)
+#define strdup(text) alloc_strdup(text, __func__, __LINE__)
+#define free(ptr) alloc_free(ptr)
+
+// Starts counting a command of the main loop.
+static void alloc_profile_begin()
+{
+    pthread_mutex_lock(&alloc_profile.lock);
+    alloc_profile.command_allocations = alloc_profile.command_bytes = 0;
+    alloc_profile.command_live = alloc_profile.command_peak = alloc_profile.live;
+    pthread_mutex_unlock(&alloc_profile.lock);
+}
+
+static void alloc_profile_end(const char *name)
+{
+    pthread_mutex_lock(&alloc_profile.lock);
+    struct alloc_command *command = &alloc_profile.commands[alloc_profile.command_count++ % ALLOC_COMMANDS];
+    snprintf(command->name, sizeof(command->name), "%s", name);
+    command->allocations = alloc_profile.command_allocations;
+    command->bytes = alloc_profile.command_bytes;
+    command->peak = alloc_profile.command_peak - alloc_profile.command_live;
+    command->retained = (long)alloc_profile.live - (long)alloc_profile.command_live;
+    pthread_mutex_unlock(&alloc_profile.lock);
+}
+
+static int compare_sites(const void *a, const void *b)
+{
+    const struct alloc_site *x = a, *y = b;
+    if (x->live_bytes != y->live_bytes)
+        return x->live_bytes < y->live_bytes ? 1 : -1;
+    return (x->allocations < y->allocations) - (x->allocations > y->allocations);
+}
+
+static void alloc_profile_print()
+{
+    struct alloc_site sites[ALLOC_SITES];
+    struct alloc_command commands[ALLOC_COMMANDS];
+
+    pthread_mutex_lock(&alloc_profile.lock);
+    memcpy(sites, alloc_profile.sites, sizeof(sites));
+    memcpy(commands, alloc_profile.commands, sizeof(commands));
+    int count = alloc_profile.command_count;
+    printf("%lu allocations, %lu bytes, %zu bytes live, peak %zu bytes\n",
+           alloc_profile.allocations, alloc_profile.bytes, alloc_profile.live, alloc_profile.peak);
+    pthread_mutex_unlock(&alloc_profile.lock);
+
+    printf("\n%-20s %12s %12s %12s %12s\n", "command", "allocations", "bytes", "peak", "retained");
+    for (int i = count > ALLOC_COMMANDS ? count - ALLOC_COMMANDS : 0; i < count; i++)
+    {
+        struct alloc_command *command = &commands[i % ALLOC_COMMANDS];
+        printf("%-20s %12lu %12lu %12zu %12ld\n", command->name, command->allocations, command->bytes, command->peak, command->retained);
+    }
+
+    qsort(sites, ALLOC_SITES, sizeof(struct alloc_site), compare_sites);
+    printf("\n%-28s %12s %12s %12s %12s\n", "site", "allocations", "bytes", "live blocks", "live bytes");
+    for (int i = 0; i < ALLOC_SITES && sites[i].function; i++)
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "%s:%d", sites[i].function, sites[i].line);
+        printf("%-28s %12lu %12lu %12lu %12zu\n", name, sites[i].allocations, sites[i].bytes, sites[i].live_blocks, sites[i].live_bytes);
+    }
+}
+
+// Clears the counts of the commands and the totals of the sites. Live blocks
+// are still tracked.
+static void alloc_profile_reset()
+{
+    pthread_mutex_lock(&alloc_profile.lock);
+    for (int i = 0; i < ALLOC_SITES; i++)
+        alloc_profile.sites[i].allocations = alloc_profile.sites[i].bytes = 0;
+    alloc_profile.allocations = alloc_profile.bytes = 0;
+    alloc_profile.peak = alloc_profile.command_peak = alloc_profile.live;
+    alloc_profile.command_count = 0;
+    pthread_mutex_unlock(&alloc_profile.lock);
+}
+#else
+static void alloc_profile_begin() {}
+static void alloc_profile_end(const char *name) {}
+#endif
+
 enum return_codes
 {
     SUCCESS = 0,
@@ -34,6 +321,7 @@ struct command_t
     bool auto_complete;
     int arg_count;
     char **args;
+    char *arg_text; // the arguments, args[] points into it
     char *redirects[3];		// in/out redirection
     struct command_t *next; // for piping
 };
@@ -68,12 +356,8 @@ void print_command(struct command_t *command)
  */
 int free_command(struct command_t *command)
 {
-    if (command->arg_count)
-    {
-        for (int i = 0; i < command->arg_count; ++i)
-            free(command->args[i]);
-        free(command->args);
-    }
+    free(command->arg_text);
+    free(command->args);
     for (int i = 0; i < 3; ++i)
         if (command->redirects[i])
             free(command->redirects[i]);
@@ -87,755 +371,4358 @@ int free_command(struct command_t *command)
     return 0;
 }
 
+// Screen updates of the line editor are collected here and written with a
+// single write() per update.
+struct render
+{
+    char buf[8192];
+    size_t len;
+};
+
+static struct render screen;
+
+void render_append(const char *text, size_t len)
+{
+    if (screen.len + len > sizeof(screen.buf))
+        len = sizeof(screen.buf) - screen.len;
+    memcpy(screen.buf + screen.len, text, len);
+    screen.len += len;
+}
+
+void render_printf(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(screen.buf + screen.len, sizeof(screen.buf) - screen.len, format, args);
+    va_end(args);
+    if (len > 0)
+        screen.len += len < sizeof(screen.buf) - screen.len ? len : sizeof(screen.buf) - screen.len - 1;
+}
+
+// Input read from the terminal and not consumed yet. The prompt and the
+// builtins that ask for a line read through it instead of stdio, so the shell
+// knows when a paste is still being processed.
+struct input_buffer
+{
+    unsigned char buf[4096];
+    size_t pos;
+    size_t len;
+};
+
+static struct input_buffer terminal_input;
+
+// Returns the next byte of input, or EOF. Output written through stdio is
+// flushed before the terminal is read, as stdio does for stdin.
+int input_getchar()
+{
+    if (terminal_input.pos == terminal_input.len)
+    {
+        fflush(stdout);
+        ssize_t n;
+        do
+            n = read(STDIN_FILENO, terminal_input.buf, sizeof(terminal_input.buf));
+        while (n < 0 && errno == EINTR);
+        if (n <= 0)
+            return EOF;
+        terminal_input.pos = 0;
+        terminal_input.len = n;
+    }
+    return terminal_input.buf[terminal_input.pos++];
+}
+
+// Reads a line like getline(). Returns its length with the newline, or -1 at
+// the end of the input.
+ssize_t input_getline(char **line, size_t *size)
+{
+    ssize_t len = 0;
+    int c = 0;
+    while (c != '\n' && (c = input_getchar()) != EOF)
+    {
+        if (len + 2 > *size)
+        {
+            *size = *size ? *size * 2 : 128;
+            *line = realloc(*line, *size);
+        }
+        (*line)[len++] = c;
+    }
+    if (len == 0)
+        return -1;
+    (*line)[len] = 0;
+    return len;
+}
+
+// Returns true if input_getchar() can return without reading the terminal,
+// i.e. a paste is still being processed and the screen can be updated later.
+static bool input_pending()
+{
+    return terminal_input.pos < terminal_input.len;
+}
+
+void render_flush()
+{
+    fflush(stdout); // keep the order with output written through stdio
+    size_t written = 0;
+    while (written < screen.len)
+    {
+        ssize_t n = write(STDOUT_FILENO, screen.buf + written, screen.len - written);
+        if (n <= 0 && errno != EINTR)
+            break;
+        if (n > 0)
+            written += n;
+    }
+    screen.len = 0;
+}
+
+// The user and host name are read once, the working directory only when a
+// builtin changes it.
+struct prompt_state
+{
+    char user[256];
+    char hostname[256];
+    char cwd[1024];
+};
+
+static struct prompt_state prompt_state;
+
+void prompt_refresh_cwd()
+{
+    if (getcwd(prompt_state.cwd, sizeof(prompt_state.cwd)) == NULL)
+        strcpy(prompt_state.cwd, "?");
+}
+
+void prompt_init()
+{
+    const char *user = getenv("USER");
+    snprintf(prompt_state.user, sizeof(prompt_state.user), "%s", user ? user : "(null)");
+    gethostname(prompt_state.hostname, sizeof(prompt_state.hostname));
+    prompt_refresh_cwd();
+}
+
 /**
  * Show the command prompt
  * @return [description]
  */
 int show_prompt()
 {
-    char cwd[1024], hostname[1024];
-    gethostname(hostname, sizeof(hostname));
-    getcwd(cwd, sizeof(cwd));
-    printf("%s@%s:%s %s$ ", getenv("USER"), hostname, cwd, sysname);
+    render_printf("%s@%s:%s %s$ ", prompt_state.user, prompt_state.hostname, prompt_state.cwd, sysname);
     return 0;
 }
 
-/**
- * Parse a command string into a command struct
- * @param  buf     [description]
- * @param  command [description]
- * @return         0
- */
-int parse_command(char *buf, struct command_t *command)
+// The terminal stays in raw mode (no canonical input, no echo) for the whole
+// interactive session. Only commands that read the terminal themselves get it
+// back in canonical mode while they run.
+static struct termios cooked_termios, raw_termios;
+static bool is_terminal = false, raw_mode = false;
+
+void terminal_init()
 {
-    const char *splitters = " \t"; // split at whitespace
-    int index, len;
-    len = strlen(buf);
-    while (len > 0 && strchr(splitters, buf[0]) != NULL) // trim left whitespace
+    // tcgetattr gets the parameters of the current terminal
+    // STDIN_FILENO will tell tcgetattr that it should write the settings
+    // of stdin to oldt
+    is_terminal = tcgetattr(STDIN_FILENO, &cooked_termios) == 0;
+    raw_termios = cooked_termios;
+    // ICANON normally takes care that one line at a time will be processed
+    // that means it will return if it sees a "\n" or an EOF or an EOL
+    raw_termios.c_lflag &= ~(ICANON | ECHO); // Also disable automatic echo. We manually echo each char.
+}
+
+void terminal_raw()
+{
+    // TCSANOW tells tcsetattr to change attributes immediately.
+    if (is_terminal && !raw_mode)
+        tcsetattr(STDIN_FILENO, TCSANOW, &raw_termios);
+    raw_mode = true;
+}
+
+void terminal_cooked()
+{
+    if (is_terminal && raw_mode)
+        tcsetattr(STDIN_FILENO, TCSANOW, &cooked_termios);
+    raw_mode = false;
+}
+
+// The arguments of a command are stored one after another in a single
+// buffer, args[] points into it once parsing is done. While the buffer grows,
+// args[] holds offsets into it instead of pointers.
+struct arg_arena
+{
+    char *text;
+    size_t len, capacity;
+    char **args;
+    int count, args_capacity;
+};
+
+static void arena_push(struct arg_arena *arena, const char *arg, size_t len)
+{
+    if (arena->len + len + 1 > arena->capacity)
     {
-        buf++;
-        len--;
+        arena->capacity = (arena->len + len + 1) * 2 > 256 ? (arena->len + len + 1) * 2 : 256;
+        arena->text = realloc(arena->text, arena->capacity);
     }
-    while (len > 0 && strchr(splitters, buf[len - 1]) != NULL)
-        buf[--len] = 0; // trim right whitespace
+    if (arena->count + 2 > arena->args_capacity) // and the NULL at the end
+    {
+        arena->args_capacity = arena->args_capacity ? arena->args_capacity * 2 : 8;
+        arena->args = realloc(arena->args, sizeof(char *) * arena->args_capacity);
+    }
+    memcpy(arena->text + arena->len, arg, len);
+    arena->text[arena->len + len] = 0;
+    arena->args[arena->count++] = (char *)(uintptr_t)arena->len;
+    arena->len += len + 1;
+}
 
-    if (len > 0 && buf[len - 1] == '?') // auto-complete
-        command->auto_complete = true;
-    if (len > 0 && buf[len - 1] == '&') // background
-        command->background = true;
+// Turns the offsets into pointers, args[] is terminated by NULL.
+static void arena_finish(struct arg_arena *arena, struct command_t *command)
+{
+    if (arena->args == NULL) // args[] and the text always exist
+    {
+        arena_push(arena, "", 0);
+        arena->count = 0;
+    }
+    for (int i = 0; i < arena->count; i++)
+        arena->args[i] = arena->text + (uintptr_t)arena->args[i];
+    arena->args[arena->count] = NULL;
+    command->args = arena->args;
+    command->arg_text = arena->text;
+    command->arg_count = arena->count;
+}
 
-    char *pch = strtok(buf, splitters);
-    command->name = (char *)malloc(strlen(pch) + 1);
-    if (pch == NULL)
-        command->name[0] = 0;
-    else
-        strcpy(command->name, pch);
+// Glob expansion of arguments. A pattern is compiled once into components,
+// one per part of the path, and each directory a component has to look into
+// is read with a single getdents64() pass that matches every entry against
+// it. A component without wildcards is looked up directly and `**` matches
+// any number of directories (not hidden ones, and no symbolic links to them).
+// The matches of a pattern are sorted by strcmp(). A pattern without matches
+// is passed on unchanged, like other shells do.
+#define GLOB_COMPONENTS 64
+#define GLOB_TOKENS 256
+#define GLOB_CLASSES 16
 
-    command->args = (char **)malloc(sizeof(char *));
+enum glob_ops
+{
+    GLOB_CHAR,
+    GLOB_ANY,   // ?
+    GLOB_STAR,  // *
+    GLOB_CLASS, // [...]
+};
 
-    int redirect_index;
-    int arg_index = 0;
-    char temp_buf[1024], *arg;
+struct glob_token
+{
+    unsigned char op;
+    unsigned char c; // the character, or the class
+};
 
-    while (1)
-    {
-        // tokenize input on splitters
-        pch = strtok(NULL, splitters);
-        if (!pch)
-            break;
-        arg = temp_buf;
-        strcpy(arg, pch);
-        len = strlen(arg);
+struct glob_component
+{
+    const char *text; // the component without wildcards, a literal name
+    int first, count; // tokens
+    bool literal;
+    bool globstar; // the component is **
+    bool dot;      // starts with a dot, so hidden names can match
+};
 
-        if (len == 0)
-            continue;										 // empty arg, go for next
-        while (len > 0 && strchr(splitters, arg[0]) != NULL) // trim left whitespace
+struct glob_pattern
+{
+    bool absolute;
+    bool directory; // ends with a slash, only directories match
+    int component_count;
+    struct glob_component components[GLOB_COMPONENTS];
+    struct glob_token tokens[GLOB_TOKENS];
+    int token_count;
+    unsigned char classes[GLOB_CLASSES][32]; // a bit per character
+    int class_count;
+    char text[PATH_MAX]; // the components, separated by NUL
+};
+
+// Compiles a bracket expression at text[0] == '['. Returns its length, or 0 if
+// it is not closed, then the bracket is an ordinary character.
+static int glob_compile_class(const char *text, struct glob_pattern *pattern)
+{
+    if (pattern->class_count == GLOB_CLASSES)
+        return 0;
+    unsigned char *bits = pattern->classes[pattern->class_count];
+    memset(bits, 0, 32);
+
+    int i = 1;
+    bool negate = text[i] == '!' || text[i] == '^';
+    if (negate)
+        i++;
+    for (bool first = true; text[i] && (text[i] != ']' || first); first = false)
+    {
+        unsigned char from = text[i], to = from;
+        if (text[i + 1] == '-' && text[i + 2] && text[i + 2] != ']')
         {
-            arg++;
-            len--;
+            to = text[i + 2];
+            i += 2;
         }
-        while (len > 0 && strchr(splitters, arg[len - 1]) != NULL)
-            arg[--len] = 0; // trim right whitespace
-        if (len == 0)
-            continue; // empty arg, go for next
+        for (int c = from; c <= to; c++)
+            bits[c / 8] |= 1 << c % 8;
+        i++;
+    }
+    if (text[i] != ']')
+        return 0;
 
-        // piping to another command
-        if (strcmp(arg, "|") == 0)
-        {
-            struct command_t *c = malloc(sizeof(struct command_t));
-            int l = strlen(pch);
-            pch[l] = splitters[0]; // restore strtok termination
-            index = 1;
-            while (pch[index] == ' ' || pch[index] == '\t')
-                index++; // skip whitespaces
+    if (negate)
+        for (int b = 0; b < 32; b++)
+            bits[b] = ~bits[b];
+    bits[0] &= ~1; // never the end of a name
+    bits['/' / 8] &= ~(1 << '/' % 8);
+    return i + 1;
+}
 
-            parse_command(pch + index, c);
-            pch[l] = 0; // put back strtok termination
-            command->next = c;
-            continue;
-        }
+/**
+ * Compiles a glob pattern
+ * @param  text    the pattern
+ * @param  pattern compiled pattern
+ * @return         0, or -1 if the pattern is too long or complex, then it is
+ *                 passed on unchanged
+ */
+static int glob_compile(const char *text, struct glob_pattern *pattern)
+{
+    size_t len = strlen(text);
+    if (len >= sizeof(pattern->text))
+        return -1;
+    memcpy(pattern->text, text, len + 1);
+    pattern->absolute = text[0] == '/';
+    pattern->directory = len > 1 && text[len - 1] == '/';
+    pattern->component_count = pattern->token_count = pattern->class_count = 0;
 
-        // background process
-        if (strcmp(arg, "&") == 0)
-            continue; // handled before
+    char *saveptr;
+    for (char *part = strtok_r(pattern->text, "/", &saveptr); part; part = strtok_r(NULL, "/", &saveptr))
+    {
+        if (pattern->component_count == GLOB_COMPONENTS)
+            return -1;
+        struct glob_component *component = &pattern->components[pattern->component_count++];
+        component->text = part;
+        component->first = pattern->token_count;
+        component->globstar = strcmp(part, "**") == 0;
+        component->dot = part[0] == '.';
+        component->literal = true;
 
-        // handle input redirection
-        redirect_index = -1;
-        if (arg[0] == '<')
-            redirect_index = 0;
-        if (arg[0] == '>')
+        for (int i = 0; part[i] && !component->globstar;)
         {
-            if (len > 1 && arg[1] == '>')
+            if (pattern->token_count == GLOB_TOKENS)
+                return -1;
+            struct glob_token *token = &pattern->tokens[pattern->token_count++];
+            int class_len = part[i] == '[' ? glob_compile_class(part + i, pattern) : 0;
+            if (class_len)
             {
-                redirect_index = 2;
-                arg++;
-                len--;
+                token->op = GLOB_CLASS;
+                token->c = pattern->class_count++;
+                i += class_len;
             }
             else
-                redirect_index = 1;
+            {
+                token->op = part[i] == '*' ? GLOB_STAR : part[i] == '?' ? GLOB_ANY : GLOB_CHAR;
+                token->c = part[i++];
+                if (token->op == GLOB_STAR && token > pattern->tokens + component->first && token[-1].op == GLOB_STAR)
+                    pattern->token_count--; // ** inside a name is *
+            }
+            component->literal = component->literal && token->op == GLOB_CHAR;
         }
-        if (redirect_index != -1)
+        component->literal = component->literal && !component->globstar;
+        component->count = pattern->token_count - component->first;
+    }
+    return pattern->component_count ? 0 : -1;
+}
+
+// Matches a name against a component. A star remembers where it was, and a
+// mismatch after it lets the star take one more character, so there is no
+// recursion.
+static bool glob_match(const struct glob_pattern *pattern, const struct glob_component *component, const char *name)
+{
+    if (name[0] == '.' && !component->dot)
+        return false;
+    if (component->globstar)
+        return true;
+
+    const struct glob_token *token = pattern->tokens + component->first, *end = token + component->count;
+    const struct glob_token *star = NULL;
+    const char *star_name = NULL;
+    while (*name)
+    {
+        if (token < end && token->op == GLOB_STAR)
         {
-            command->redirects[redirect_index] = malloc(len);
-            strcpy(command->redirects[redirect_index], arg + 1);
+            star = ++token;
+            star_name = name;
             continue;
         }
-
-        // normal arguments
-        if (len > 2 && ((arg[0] == '"' && arg[len - 1] == '"') || (arg[0] == '\'' && arg[len - 1] == '\''))) // quote wrapped arg
+        if (token < end && (token->op == GLOB_ANY
+                            || (token->op == GLOB_CHAR && token->c == (unsigned char)*name)
+                            || (token->op == GLOB_CLASS && pattern->classes[token->c][(unsigned char)*name / 8] & 1 << (unsigned char)*name % 8)))
         {
-            arg[--len] = 0;
-            arg++;
+            token++;
+            name++;
+            continue;
         }
-        command->args = (char **)realloc(command->args, sizeof(char *) * (arg_index + 1));
-        command->args[arg_index] = (char *)malloc(len + 1);
-        strcpy(command->args[arg_index++], arg);
+        if (star == NULL)
+            return false;
+        token = star;
+        name = ++star_name;
     }
-    command->arg_count = arg_index;
-    return 0;
+    while (token < end && token->op == GLOB_STAR)
+        token++;
+    return token == end;
 }
 
-void prompt_backspace()
+struct glob_walk
 {
-    putchar(8);	  // go back 1
-    putchar(' '); // write empty over
-    putchar(8);	  // go back 1 again
+    const struct glob_pattern *pattern;
+    struct arg_arena *arena;
+    char path[PATH_MAX]; // the directory being read, with a slash at its end
+    char dirents[32768];
+    // directories to go into once a directory is read, as a byte with the
+    // next component and the name, with a NUL after it
+    char *pending;
+    size_t pending_len, pending_capacity;
+};
+
+static void glob_pending(struct glob_walk *walk, int component, const char *name)
+{
+    size_t len = strlen(name) + 2;
+    if (walk->pending_len + len > walk->pending_capacity)
+    {
+        walk->pending_capacity = (walk->pending_len + len) * 2;
+        walk->pending = realloc(walk->pending, walk->pending_capacity);
+    }
+    walk->pending[walk->pending_len] = component;
+    memcpy(walk->pending + walk->pending_len + 1, name, len - 1);
+    walk->pending_len += len;
+}
+
+// Adds path + name as a match, if it is a directory when it has to be.
+static void glob_emit(struct glob_walk *walk, size_t path_len, int dir_fd, const char *name, unsigned char type)
+{
+    struct stat st;
+    if (walk->pattern->directory && type != DT_DIR
+        && ((type != DT_LNK && type != DT_UNKNOWN) || fstatat(dir_fd, name, &st, 0) != 0 || !S_ISDIR(st.st_mode)))
+        return;
+
+    size_t name_len = strlen(name);
+    if (path_len + name_len + 2 > sizeof(walk->path))
+        return;
+    memcpy(walk->path + path_len, name, name_len);
+    if (walk->pattern->directory)
+        walk->path[path_len + name_len++] = '/';
+    arena_push(walk->arena, walk->path, path_len + name_len);
+}
+
+static void glob_walk(struct glob_walk *walk, int dir_fd, size_t path_len, int index);
+
+// Goes into the directory name of dir_fd and matches the components from
+// index on in it.
+static void glob_enter(struct glob_walk *walk, int dir_fd, size_t path_len, const char *name, int index)
+{
+    size_t name_len = strlen(name);
+    if (path_len + name_len + 2 > sizeof(walk->path))
+        return;
+    int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    memcpy(walk->path + path_len, name, name_len);
+    walk->path[path_len + name_len] = '/';
+    glob_walk(walk, fd, path_len + name_len + 1, index);
+    close(fd);
+}
+
+// Matches the components from index on in the directory dir_fd, which is
+// walk->path up to path_len.
+static void glob_walk(struct glob_walk *walk, int dir_fd, size_t path_len, int index)
+{
+    const struct glob_pattern *pattern = walk->pattern;
+    const struct glob_component *component = &pattern->components[index];
+    bool last = index == pattern->component_count - 1;
+
+    if (component->literal)
+    {
+        struct stat st;
+        if (!last)
+            glob_enter(walk, dir_fd, path_len, component->text, index + 1);
+        else if (fstatat(dir_fd, component->text, &st, AT_SYMLINK_NOFOLLOW) == 0)
+            glob_emit(walk, path_len, dir_fd, component->text, S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK : DT_REG);
+        return;
+    }
+
+    // For **, the entries are matched against the next component as well,
+    // which is ** matching no directory.
+    const struct glob_component *next = component->globstar && !last ? component + 1 : NULL;
+    int next_index = next ? index + 1 : index;
+    size_t pending_start = walk->pending_len;
+    ssize_t len;
+    while ((len = getdents64(dir_fd, walk->dirents, sizeof(walk->dirents))) > 0)
+    {
+        for (ssize_t pos = 0; pos < len;)
+        {
+            struct dirent64 *entry = (struct dirent64 *)(walk->dirents + pos);
+            pos += entry->d_reclen;
+
+            const char *name = entry->d_name;
+            if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+                continue;
+            bool maybe_dir = entry->d_type == DT_DIR || entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN;
+
+            if (glob_match(pattern, next ? next : component, name))
+            {
+                if (next_index == pattern->component_count - 1)
+                    glob_emit(walk, path_len, dir_fd, name, entry->d_type);
+                else if (maybe_dir)
+                    glob_pending(walk, next_index + 1, name);
+            }
+
+            if (component->globstar && name[0] != '.')
+            {
+                struct stat st;
+                bool dir = entry->d_type == DT_DIR
+                           || (entry->d_type == DT_UNKNOWN && fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode));
+                if (dir)
+                    glob_pending(walk, index, name);
+            }
+        }
+    }
+
+    // The buffer can move while the directories are walked, so it is indexed.
+    for (size_t pos = pending_start; pos < walk->pending_len;)
+    {
+        int next_component = walk->pending[pos];
+        char name[NAME_MAX + 1];
+        strcpy(name, walk->pending + pos + 1);
+        pos += strlen(name) + 2;
+        glob_enter(walk, dir_fd, path_len, name, next_component);
+    }
+    walk->pending_len = pending_start;
+}
+
+static int glob_compare(const void *a, const void *b, void *text)
+{
+    return strcmp((char *)text + *(const uintptr_t *)a, (char *)text + *(const uintptr_t *)b);
+}
+
+/**
+ * Expands a glob pattern into the arguments
+ * @param  arg   the pattern
+ * @param  arena arguments of the command
+ * @return       number of matches, sorted and added to the arena
+ */
+static int glob_expand(const char *arg, struct arg_arena *arena)
+{
+    struct glob_pattern *pattern = malloc(sizeof(struct glob_pattern));
+    struct glob_walk *walk = malloc(sizeof(struct glob_walk));
+    int first = arena->count;
+
+    if (glob_compile(arg, pattern) == 0)
+    {
+        walk->pattern = pattern;
+        walk->arena = arena;
+        walk->pending = NULL;
+        walk->pending_len = walk->pending_capacity = 0;
+        walk->path[0] = '/';
+
+        int fd = open(pattern->absolute ? "/" : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0)
+        {
+            glob_walk(walk, fd, pattern->absolute ? 1 : 0, 0);
+            close(fd);
+        }
+        free(walk->pending);
+        if (arena->count - first > 1)
+            qsort_r(arena->args + first, arena->count - first, sizeof(char *), glob_compare, arena->text);
+    }
+
+    free(walk);
+    free(pattern);
+    return arena->count - first;
+}
+
+/**
+ * Parse a command string into a command struct
+ * @param  buf     [description]
+ * @param  command [description]
+ * @return         0
+ */
+int parse_command(char *buf, struct command_t *command)
+{
+    const char *splitters = " \t"; // split at whitespace
+    int index, len;
+    len = strlen(buf);
+    while (len > 0 && strchr(splitters, buf[0]) != NULL) // trim left whitespace
+    {
+        buf++;
+        len--;
+    }
+    while (len > 0 && strchr(splitters, buf[len - 1]) != NULL)
+        buf[--len] = 0; // trim right whitespace
+
+    if (len > 0 && buf[len - 1] == '&') // background
+        command->background = true;
+
+    char *pch = strtok(buf, splitters);
+    command->name = (char *)malloc(pch ? strlen(pch) + 1 : 1);
+    if (pch == NULL)
+        command->name[0] = 0;
+    else
+        strcpy(command->name, pch);
+
+    struct arg_arena arena = {0};
+
+    int redirect_index;
+    char temp_buf[1024], *arg;
+
+    while (1)
+    {
+        // tokenize input on splitters
+        pch = strtok(NULL, splitters);
+        if (!pch)
+            break;
+        arg = temp_buf;
+        strcpy(arg, pch);
+        len = strlen(arg);
+
+        if (len == 0)
+            continue;										 // empty arg, go for next
+        while (len > 0 && strchr(splitters, arg[0]) != NULL) // trim left whitespace
+        {
+            arg++;
+            len--;
+        }
+        while (len > 0 && strchr(splitters, arg[len - 1]) != NULL)
+            arg[--len] = 0; // trim right whitespace
+        if (len == 0)
+            continue; // empty arg, go for next
+
+        // piping to another command
+        if (strcmp(arg, "|") == 0)
+        {
+            struct command_t *c = calloc(1, sizeof(struct command_t));
+            int l = strlen(pch);
+            pch[l] = splitters[0]; // restore strtok termination
+            index = 1;
+            while (pch[index] == ' ' || pch[index] == '\t')
+                index++; // skip whitespaces
+
+            parse_command(pch + index, c);
+            pch[l] = 0; // put back strtok termination
+            command->next = c;
+            continue;
+        }
+
+        // background process
+        if (strcmp(arg, "&") == 0)
+            continue; // handled before
+
+        // handle input redirection
+        redirect_index = -1;
+        if (arg[0] == '<')
+            redirect_index = 0;
+        if (arg[0] == '>')
+        {
+            if (len > 1 && arg[1] == '>')
+            {
+                redirect_index = 2;
+                arg++;
+                len--;
+            }
+            else
+                redirect_index = 1;
+        }
+        if (redirect_index != -1)
+        {
+            command->redirects[redirect_index] = malloc(len);
+            strcpy(command->redirects[redirect_index], arg + 1);
+            continue;
+        }
+
+        // normal arguments
+        if (len > 2 && ((arg[0] == '"' && arg[len - 1] == '"') || (arg[0] == '\'' && arg[len - 1] == '\''))) // quote wrapped arg
+        {
+            arg[--len] = 0;
+            arg++;
+        }
+        else if (strpbrk(arg, "*?[") && glob_expand(arg, &arena) > 0) // patterns in quotes are not
+            continue;
+        arena_push(&arena, arg, len);
+    }
+    arena_finish(&arena, command);
+    return 0;
+}
+
+// Latency statistics. Every phase of a command (and every builtin, see
+// builtin_latency) records its duration in a histogram with one bucket per power
+// of two nanoseconds, so recording is a clock read and an increment and the
+// memory used is fixed. They are off unless SHELLFYRE_STATS is set to
+// something other than 0 at startup, or `stats on` turns them on. If
+// SHELLFYRE_TRACE names a file, statistics are on and every measurement is
+// also appended to it as a line of JSON.
+#define STATS_BUCKETS 64
+
+enum phases
+{
+    PHASE_PROMPT, // prompt() until enter, including typing
+    PHASE_PARSE,
+    PHASE_RESOLVE, // find_path()
+    PHASE_EXEC,    // fork() until exec() succeeded or failed in the child
+    PHASE_CHILD,   // fork() until the child exited
+    PHASE_COUNT,
+};
+
+static const char *phase_names[PHASE_COUNT] = {"prompt", "parse", "resolve", "exec", "child"};
+
+struct histogram
+{
+    unsigned int buckets[STATS_BUCKETS]; // buckets[i] counts durations below 2^i ns
+    unsigned int count;
+    unsigned long long max;
+};
+
+struct stats
+{
+    bool enabled;
+    FILE *trace;
+    struct histogram phases[PHASE_COUNT];
+};
+
+static struct stats stats;
+
+// Returns the monotonic time in ns, or 0 if statistics are disabled.
+static inline unsigned long long stats_begin()
+{
+    if (!stats.enabled)
+        return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void stats_trace(const char *phase, const char *name, unsigned long long start, unsigned long long ns)
+{
+    fprintf(stats.trace, "{\"ts\":%llu,\"phase\":\"%s\",\"name\":\"", start, phase);
+    for (; name && *name; name++) // command names come from the user
+    {
+        if (*name == '"' || *name == '\\')
+            fputc('\\', stats.trace);
+        if ((unsigned char)*name >= 32)
+            fputc(*name, stats.trace);
+    }
+    fprintf(stats.trace, "\",\"ns\":%llu}\n", ns);
+}
+
+// Records the time since start, which came from stats_begin().
+void stats_end(struct histogram *histogram, const char *phase, const char *name, unsigned long long start)
+{
+    if (!stats.enabled || start == 0)
+        return;
+    unsigned long long ns = stats_begin() - start;
+    int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+    histogram->buckets[bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1]++;
+    histogram->count++;
+    if (ns > histogram->max)
+        histogram->max = ns;
+    if (stats.trace)
+        stats_trace(phase, name, start, ns);
+}
+
+static inline void stats_phase(enum phases phase, const char *name, unsigned long long start)
+{
+    stats_end(&stats.phases[phase], phase_names[phase], name, start);
+}
+
+void stats_init()
+{
+    const char *enabled = getenv("SHELLFYRE_STATS");
+    stats.enabled = enabled && enabled[0] && strcmp(enabled, "0") != 0;
+
+    const char *trace = getenv("SHELLFYRE_TRACE");
+    if (trace && trace[0])
+    {
+        stats.trace = fopen(trace, "ae");
+        if (stats.trace == NULL)
+            printf("-%s: %s: %s\n", sysname, trace, strerror(errno));
+        else
+            stats.enabled = true;
+    }
+}
+
+// Upper bound of the bucket holding the given fraction of the durations.
+unsigned long long stats_percentile(struct histogram *histogram, double fraction)
+{
+    unsigned int rank = histogram->count * fraction, seen = 0;
+    for (int i = 0; i < STATS_BUCKETS; i++)
+    {
+        seen += histogram->buckets[i];
+        if (seen > rank)
+            return i ? 1ULL << i : 1;
+    }
+    return histogram->max;
+}
+
+void stats_print(const char *name, struct histogram *histogram)
+{
+    if (histogram->count == 0)
+        return;
+    unsigned long long p50 = stats_percentile(histogram, 0.5), p99 = stats_percentile(histogram, 0.99);
+    printf("%-12s %8u %12.1f %12.1f %12.1f\n", name, histogram->count,
+           (p50 < histogram->max ? p50 : histogram->max) / 1000.0,
+           (p99 < histogram->max ? p99 : histogram->max) / 1000.0, histogram->max / 1000.0);
+}
+
+// Command history. Lines are kept in memory and appended to history_file, and
+// a trigram index makes a reverse search cost one posting list walk instead of
+// a scan of the whole history. Queries shorter than a trigram are answered from
+// per-block summaries of the characters and pairs of characters of 64 entries.
+// Entry ids only grow; entries older than history.base were dropped to keep the
+// history bounded.
+#define HISTORY_BUCKETS (1 << 16)
+#define HISTORY_DEFAULT_SIZE 10000
+#define HISTORY_BLOCK 64
+
+// Characters (exact) and bigrams (hashed) that occur in a block of entries.
+struct history_block
+{
+    unsigned long long chars[4];
+    unsigned long long bigrams[8];
+};
+
+struct posting_list
+{
+    int *ids;
+    int count;
+    int capacity;
+};
+
+struct history
+{
+    bool loaded;
+    int fd;
+    int max_size;
+    char **lines; // lines[id - base]
+    int base;
+    int count;
+    int capacity;
+    struct posting_list *index;
+    struct history_block *blocks; // blocks[(id - base) / HISTORY_BLOCK]
+};
+
+static struct history history = {.fd = -1};
+
+static unsigned int trigram_hash(const char *s)
+{
+    unsigned int h = ((unsigned char)s[0] << 16) | ((unsigned char)s[1] << 8) | (unsigned char)s[2];
+    return (h * 2654435761u) >> 16 & (HISTORY_BUCKETS - 1);
+}
+
+static unsigned int bigram_hash(const char *s)
+{
+    return ((unsigned char)s[0] * 31 + (unsigned char)s[1]) & 511;
+}
+
+static bool block_has(struct history_block *block, const char *query, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        unsigned char c = query[i];
+        if (!(block->chars[c >> 6] & (1ULL << (c & 63))))
+            return false;
+    }
+    if (len == 2)
+    {
+        unsigned int h = bigram_hash(query);
+        return block->bigrams[h >> 6] & (1ULL << (h & 63));
+    }
+    return true;
+}
+
+static void history_index_line(int id, const char *line)
+{
+    int slot = id - history.base;
+    if (slot % HISTORY_BLOCK == 0)
+    {
+        history.blocks = realloc(history.blocks, sizeof(struct history_block) * (slot / HISTORY_BLOCK + 1));
+        memset(&history.blocks[slot / HISTORY_BLOCK], 0, sizeof(struct history_block));
+    }
+    struct history_block *block = &history.blocks[slot / HISTORY_BLOCK];
+    for (int i = 0; line[i]; i++)
+    {
+        unsigned char c = line[i];
+        block->chars[c >> 6] |= 1ULL << (c & 63);
+        if (line[i + 1])
+        {
+            unsigned int h = bigram_hash(line + i);
+            block->bigrams[h >> 6] |= 1ULL << (h & 63);
+        }
+    }
+
+    for (int i = 0; line[i] && line[i + 1] && line[i + 2]; i++)
+    {
+        struct posting_list *list = &history.index[trigram_hash(line + i)];
+        if (list->count > 0 && list->ids[list->count - 1] == id)
+            continue; // trigram already seen in this line
+        if (list->count == list->capacity)
+        {
+            list->capacity = list->capacity ? list->capacity * 2 : 4;
+            list->ids = realloc(list->ids, sizeof(int) * list->capacity);
+        }
+        list->ids[list->count++] = id;
+    }
+}
+
+static void history_push(const char *line)
+{
+    if (history.count == history.capacity)
+    {
+        history.capacity = history.capacity ? history.capacity * 2 : 1024;
+        history.lines = realloc(history.lines, sizeof(char *) * history.capacity);
+    }
+    int id = history.base + history.count;
+    history.lines[history.count++] = strdup(line);
+    history_index_line(id, line);
+}
+
+// Drops all but the newest max_size entries, then rebuilds the index and
+// rewrites the history file. Runs once per max_size added lines.
+static void history_trim()
+{
+    int drop = history.count - history.max_size;
+    for (int i = 0; i < drop; i++)
+        free(history.lines[i]);
+    memmove(history.lines, history.lines + drop, sizeof(char *) * history.max_size);
+    history.base += drop;
+    history.count = history.max_size;
+
+    for (int i = 0; i < HISTORY_BUCKETS; i++)
+        history.index[i].count = 0;
+    for (int i = 0; i < history.count; i++)
+        history_index_line(history.base + i, history.lines[i]);
+
+    char tmp_file[1100];
+    snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", history_file);
+    FILE *fp = fopen(tmp_file, "w");
+    if (fp)
+    {
+        for (int i = 0; i < history.count; i++)
+            fprintf(fp, "%s\n", history.lines[i]);
+        if (fclose(fp) == 0 && rename(tmp_file, history_file) == 0)
+        {
+            close(history.fd);
+            history.fd = open(history_file, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+        }
+    }
+}
+
+// Reads the history file on first use.
+void history_load()
+{
+    if (history.loaded)
+        return;
+    history.loaded = true;
+
+    const char *size = getenv("SHELLFYRE_HISTSIZE");
+    history.max_size = size && atoi(size) > 0 ? atoi(size) : HISTORY_DEFAULT_SIZE;
+    history.index = calloc(HISTORY_BUCKETS, sizeof(struct posting_list));
+
+    FILE *fp = fopen(history_file, "r");
+    if (fp)
+    {
+        char *line = NULL;
+        size_t capacity = 0;
+        ssize_t len;
+        while ((len = getline(&line, &capacity, fp)) > 0)
+        {
+            if (line[len - 1] == '\n')
+                line[len - 1] = 0;
+            history_push(line);
+        }
+        free(line);
+        fclose(fp);
+    }
+    history.fd = open(history_file, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+
+    if (history.count > history.max_size)
+        history_trim();
+}
+
+// Adds a line to the history, unless it is empty or repeats the last one.
+void history_add(const char *line)
+{
+    history_load();
+    if (line[0] == 0 || strchr(line, '\n'))
+        return;
+    if (history.count > 0 && strcmp(history.lines[history.count - 1], line) == 0)
+        return;
+
+    history_push(line);
+    if (history.fd >= 0)
+    {
+        dprintf(history.fd, "%s\n", line);
+    }
+
+    if (history.count >= 2 * history.max_size)
+        history_trim();
+}
+
+// Entry id after the newest one.
+int history_end()
+{
+    history_load();
+    return history.base + history.count;
+}
+
+const char *history_get(int id)
+{
+    if (id < history.base || id >= history.base + history.count)
+        return NULL;
+    return history.lines[id - history.base];
+}
+
+/**
+ * Find the newest history entry before an id that contains the query
+ * @param  query  [description]
+ * @param  before search entries older than this id
+ * @return        entry id, or -1 if there is none
+ */
+int history_search(const char *query, int before)
+{
+    history_load();
+    if (before > history.base + history.count)
+        before = history.base + history.count;
+
+    size_t len = strlen(query);
+    if (len < 3)
+    {
+        // Skip the blocks that cannot contain the query.
+        for (int id = before - 1; id >= history.base; id--)
+        {
+            int slot = id - history.base;
+            if (!block_has(&history.blocks[slot / HISTORY_BLOCK], query, len))
+            {
+                id -= slot % HISTORY_BLOCK;
+                continue;
+            }
+            if (strstr(history.lines[slot], query))
+                return id;
+        }
+        return -1;
+    }
+
+    // Walk the shortest posting list among the trigrams of the query.
+    struct posting_list *best = NULL;
+    for (size_t i = 0; i + 2 < len; i++)
+    {
+        struct posting_list *list = &history.index[trigram_hash(query + i)];
+        if (best == NULL || list->count < best->count)
+            best = list;
+    }
+
+    int low = 0, high = best->count;
+    while (low < high) // first posting >= before
+    {
+        int mid = (low + high) / 2;
+        if (best->ids[mid] < before)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    for (int i = low - 1; i >= 0 && best->ids[i] >= history.base; i--)
+        if (strstr(history.lines[best->ids[i] - history.base], query))
+            return best->ids[i];
+    return -1;
+}
+
+void prompt_backspace()
+{
+    render_append("\b \b", 3); // go back 1, write empty over, go back 1 again
+}
+
+// Replaces the edited line on the screen and in buf with text.
+static int prompt_replace(char *buf, int index, const char *text, size_t size)
+{
+    while (index > 0)
+    {
+        prompt_backspace();
+        index--;
+    }
+    for (; text[index] && index < size - 1; index++)
+        buf[index] = text[index];
+    render_append(buf, index);
+    buf[index] = 0;
+    return index;
+}
+
+// Draws the reverse search line.
+static void show_search(const char *query, int match)
+{
+    render_printf("\r\033[K(reverse-i-search)`%s': %s", query, match >= 0 ? history_get(match) : "");
+}
+
+// Speculative prefetch. Once the first word of the line is typed, a background
+// thread resolves it with find_path() and reads the binary, its interpreter and
+// the libraries it needs (DT_NEEDED, recursively) into the page cache, so a
+// cold exec does not wait for the disk after enter. A new word or a deleted
+// one bumps the generation, which stops the work between chunks. A file read
+// in the last PREFETCH_INTERVAL seconds is not read again, and at most
+// PREFETCH_MAX_BYTES of a file are read. SHELLFYRE_PREFETCH=0 turns it off.
+#define PREFETCH_FILES 64
+#define PREFETCH_RECENT 64
+#define PREFETCH_INTERVAL 30
+#define PREFETCH_CHUNK (2 << 20)
+#define PREFETCH_MAX_BYTES (256 << 20)
+
+struct prefetch
+{
+    bool enabled;
+    bool started;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    char name[256];           // command to prefetch, empty for none
+    unsigned long generation; // bumped by every request
+    unsigned long done;       // generation of the last finished request
+    // Only used by the thread: the directory of the dynamic linker of the last
+    // binary, and the files read recently.
+    char linker_dir[PATH_MAX];
+    struct
+    {
+        dev_t dev;
+        ino_t ino;
+        time_t time;
+    } recent[PREFETCH_RECENT];
+    int recent_next;
+};
+
+static struct prefetch prefetch = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+};
+
+struct builtin;
+char *find_path(char *command_name);
+const struct builtin *find_builtin(const char *name);
+
+static bool prefetch_stale(unsigned long generation)
+{
+    return __atomic_load_n(&prefetch.generation, __ATOMIC_RELAXED) != generation;
+}
+
+// Returns true if the file was read recently, and records it otherwise.
+static bool prefetch_recent(struct stat *st)
+{
+    time_t now = time(NULL);
+    for (int i = 0; i < PREFETCH_RECENT; i++)
+        if (prefetch.recent[i].ino == st->st_ino && prefetch.recent[i].dev == st->st_dev
+            && now - prefetch.recent[i].time < PREFETCH_INTERVAL)
+            return true;
+
+    prefetch.recent[prefetch.recent_next].dev = st->st_dev;
+    prefetch.recent[prefetch.recent_next].ino = st->st_ino;
+    prefetch.recent[prefetch.recent_next].time = now;
+    prefetch.recent_next = (prefetch.recent_next + 1) % PREFETCH_RECENT;
+    return false;
+}
+
+// Translates a virtual address of an ELF file to its offset in the file.
+static const char *elf_at(const char *elf, size_t size, const Elf64_Phdr *phdrs, int count, Elf64_Addr addr)
+{
+    for (int i = 0; i < count; i++)
+        if (phdrs[i].p_type == PT_LOAD && addr >= phdrs[i].p_vaddr && addr - phdrs[i].p_vaddr < phdrs[i].p_filesz
+            && phdrs[i].p_offset + (addr - phdrs[i].p_vaddr) < size)
+            return elf + phdrs[i].p_offset + (addr - phdrs[i].p_vaddr);
+    return NULL;
+}
+
+static void prefetch_file(const char *path, unsigned long generation, int *files);
+
+// The library table of the dynamic linker, /etc/ld.so.cache in the format of
+// glibc ("glibc-ld.so.cache1.1", possibly behind a table in the old format).
+// It is mapped by the prefetch thread and mapped again when it changes.
+struct ld_cache_entry
+{
+    int32_t flags; // type and ABI of the library
+    uint32_t key, value; // name and path, offsets from the header
+    uint32_t osversion;
+    uint64_t hwcap;
+};
+
+static struct
+{
+    char *map;
+    size_t size;
+    struct timespec mtime;
+    const char *header;
+    const struct ld_cache_entry *entries;
+    uint32_t count;
+} ld_cache;
+
+#define LD_CACHE_HEADER 48
+#define LD_CACHE_ABI 0xff00
+#define LD_CACHE_ABI_32 ((1 << 0x06) | (1 << 0x08) | (1 << 0x09)) // mips n32, x32, arm hard-float
+
+static void ld_cache_load()
+{
+    struct stat st;
+    if (stat("/etc/ld.so.cache", &st) != 0 || (st.st_mtim.tv_sec == ld_cache.mtime.tv_sec && st.st_mtim.tv_nsec == ld_cache.mtime.tv_nsec))
+        return;
+    if (ld_cache.map)
+        munmap(ld_cache.map, ld_cache.size);
+    memset(&ld_cache, 0, sizeof(ld_cache));
+    ld_cache.mtime = st.st_mtim;
+
+    int fd = open("/etc/ld.so.cache", O_RDONLY | O_CLOEXEC);
+    char *map = fd >= 0 && st.st_size >= LD_CACHE_HEADER ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    if (fd >= 0)
+        close(fd);
+    if (map == MAP_FAILED)
+        return;
+    ld_cache.map = map;
+    ld_cache.size = st.st_size;
+
+    size_t offset = 0;
+    if (memcmp(map, "ld.so-1.7.0", 11) == 0)
+    {
+        uint32_t old_count;
+        memcpy(&old_count, map + 12, 4);
+        offset = (16 + (size_t)old_count * 12 + 7) & ~(size_t)7;
+    }
+    if (offset + LD_CACHE_HEADER > ld_cache.size || memcmp(map + offset, "glibc-ld.so.cache1.1", 20) != 0)
+        return;
+    uint32_t count;
+    memcpy(&count, map + offset + 20, 4);
+    if (offset + LD_CACHE_HEADER + (size_t)count * sizeof(struct ld_cache_entry) > ld_cache.size)
+        return;
+    ld_cache.header = map + offset;
+    ld_cache.entries = (const struct ld_cache_entry *)(map + offset + LD_CACHE_HEADER);
+    ld_cache.count = count;
+}
+
+// Returns a string of the table, or NULL if it is not within the file.
+static const char *ld_cache_string(uint32_t offset)
+{
+    const char *end = ld_cache.map + ld_cache.size;
+    if (offset >= (size_t)(end - ld_cache.header))
+        return NULL;
+    const char *string = ld_cache.header + offset;
+    return memchr(string, 0, end - string) ? string : NULL;
+}
+
+// Returns the path the dynamic linker loads a 64-bit library from.
+static const char *ld_cache_find(const char *name)
+{
+    for (uint32_t i = 0; i < ld_cache.count; i++)
+    {
+        const struct ld_cache_entry *entry = &ld_cache.entries[i];
+        int abi = (entry->flags & LD_CACHE_ABI) >> 8;
+        if (abi == 0 || (LD_CACHE_ABI_32 >> abi & 1))
+            continue;
+        const char *key = ld_cache_string(entry->key);
+        if (key && strcmp(key, name) == 0)
+            return ld_cache_string(entry->value);
+    }
+    return NULL;
+}
+
+// Finds a DT_NEEDED library like the dynamic linker does: in the run path of
+// the file, LD_LIBRARY_PATH, ld.so.cache, then the directory of the dynamic
+// linker and the usual default directories.
+static void prefetch_library(const char *name, const char *runpath, unsigned long generation, int *files)
+{
+    static const char *dirs[] = {prefetch.linker_dir, "/lib64", "/usr/lib64", "/lib", "/usr/lib", NULL};
+    char path[PATH_MAX + NAME_MAX + 2];
+
+    const char *paths[] = {runpath, getenv("LD_LIBRARY_PATH")};
+    for (int p = 0; p < 2; p++)
+    {
+        for (const char *dir = paths[p]; dir && *dir; dir += strcspn(dir, ":"), dir += *dir == ':')
+        {
+            int len = strcspn(dir, ":");
+            snprintf(path, sizeof(path), "%.*s/%s", len, dir, name);
+            if (access(path, R_OK) == 0)
+            {
+                prefetch_file(path, generation, files);
+                return;
+            }
+        }
+    }
+
+    const char *cached = ld_cache_find(name);
+    if (cached && access(cached, R_OK) == 0)
+    {
+        prefetch_file(cached, generation, files);
+        return;
+    }
+    for (int i = 0; dirs[i]; i++)
+    {
+        snprintf(path, sizeof(path), "%s/%s", dirs[i], name);
+        if (dirs[i][0] && access(path, R_OK) == 0)
+        {
+            prefetch_file(path, generation, files);
+            return;
+        }
+    }
+}
+
+// Reads a file into the page cache and follows the interpreter and the
+// libraries of an ELF file.
+static void prefetch_file(const char *path, unsigned long generation, int *files)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || ++*files > PREFETCH_FILES || prefetch_recent(&st))
+    {
+        close(fd);
+        return;
+    }
+
+    size_t size = st.st_size;
+    for (off_t off = 0; off < size && off < PREFETCH_MAX_BYTES && !prefetch_stale(generation); off += PREFETCH_CHUNK)
+        if (readahead(fd, off, PREFETCH_CHUNK) != 0)
+            posix_fadvise(fd, off, PREFETCH_CHUNK, POSIX_FADV_WILLNEED);
+
+    const char *elf = size >= sizeof(Elf64_Ehdr) ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (elf == MAP_FAILED)
+        return;
+
+    const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)elf;
+    if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 || ehdr->e_ident[EI_CLASS] != ELFCLASS64
+        || ehdr->e_phoff + (size_t)ehdr->e_phnum * sizeof(Elf64_Phdr) > size)
+    {
+        munmap((void *)elf, size);
+        return;
+    }
+
+    const Elf64_Phdr *phdrs = (const Elf64_Phdr *)(elf + ehdr->e_phoff);
+    const Elf64_Dyn *dynamic = NULL;
+    size_t dynamic_count = 0;
+    for (int i = 0; i < ehdr->e_phnum && !prefetch_stale(generation); i++)
+    {
+        if (phdrs[i].p_type == PT_INTERP && phdrs[i].p_offset + phdrs[i].p_filesz <= size && phdrs[i].p_filesz > 0)
+        {
+            char interp[PATH_MAX];
+            snprintf(interp, sizeof(interp), "%.*s", (int)phdrs[i].p_filesz, elf + phdrs[i].p_offset);
+            prefetch_file(interp, generation, files);
+            char *slash = strrchr(interp, '/');
+            if (slash && slash != interp)
+            {
+                *slash = 0;
+                snprintf(prefetch.linker_dir, sizeof(prefetch.linker_dir), "%s", interp);
+            }
+        }
+        if (phdrs[i].p_type == PT_DYNAMIC && phdrs[i].p_offset + phdrs[i].p_filesz <= size)
+        {
+            dynamic = (const Elf64_Dyn *)(elf + phdrs[i].p_offset);
+            dynamic_count = phdrs[i].p_filesz / sizeof(Elf64_Dyn);
+        }
+    }
+
+    const char *strtab = NULL;
+    const char *runpath = NULL;
+    size_t strsz = 0;
+    for (size_t i = 0; i < dynamic_count && dynamic[i].d_tag != DT_NULL; i++)
+    {
+        if (dynamic[i].d_tag == DT_STRTAB)
+            strtab = elf_at(elf, size, phdrs, ehdr->e_phnum, dynamic[i].d_un.d_ptr);
+        if (dynamic[i].d_tag == DT_STRSZ)
+            strsz = dynamic[i].d_un.d_val;
+    }
+    if (strtab && strtab + strsz <= elf + size && strsz > 0 && strtab[strsz - 1] == 0)
+    {
+        for (size_t i = 0; i < dynamic_count && dynamic[i].d_tag != DT_NULL; i++)
+            if ((dynamic[i].d_tag == DT_RUNPATH || dynamic[i].d_tag == DT_RPATH) && dynamic[i].d_un.d_val < strsz)
+                runpath = strtab + dynamic[i].d_un.d_val;
+        for (size_t i = 0; i < dynamic_count && dynamic[i].d_tag != DT_NULL && !prefetch_stale(generation); i++)
+            if (dynamic[i].d_tag == DT_NEEDED && dynamic[i].d_un.d_val < strsz)
+                prefetch_library(strtab + dynamic[i].d_un.d_val, runpath, generation, files);
+    }
+    munmap((void *)elf, size);
+}
+
+static void *prefetch_main(void *arg)
+{
+    char name[sizeof(prefetch.name)];
+
+    pthread_mutex_lock(&prefetch.lock);
+    while (1)
+    {
+        while (prefetch.done == prefetch.generation)
+            pthread_cond_wait(&prefetch.wake, &prefetch.lock);
+        unsigned long generation = prefetch.generation;
+        strcpy(name, prefetch.name);
+        pthread_mutex_unlock(&prefetch.lock);
+
+        char *path = name[0] ? find_path(name) : NULL;
+        int files = 0;
+        if (path)
+        {
+            ld_cache_load();
+            prefetch_file(path, generation, &files);
+        }
+        free(path);
+
+        pthread_mutex_lock(&prefetch.lock);
+        prefetch.done = generation;
+        pthread_cond_broadcast(&prefetch.wake);
+    }
+    return NULL;
+}
+
+// Asks the thread to prefetch a command, or to stop if name is empty.
+void prefetch_request(const char *name)
+{
+    if (strcmp(name, prefetch.name) == 0)
+        return;
+
+    pthread_mutex_lock(&prefetch.lock);
+    snprintf(prefetch.name, sizeof(prefetch.name), "%s", name);
+    __atomic_add_fetch(&prefetch.generation, 1, __ATOMIC_RELAXED);
+    if (!prefetch.started && pthread_create(&prefetch.thread, NULL, prefetch_main, NULL) == 0)
+    {
+        prefetch.started = true;
+        pthread_detach(prefetch.thread);
+    }
+    pthread_cond_broadcast(&prefetch.wake);
+    pthread_mutex_unlock(&prefetch.lock);
+}
+
+void prefetch_init()
+{
+    const char *enabled = getenv("SHELLFYRE_PREFETCH");
+    prefetch.enabled = is_terminal && !(enabled && strcmp(enabled, "0") == 0);
+}
+
+// Prefetches the first word of the line being typed once it is followed by a
+// space. Builtins and paths are left alone.
+static void prefetch_line(const char *buf, int len)
+{
+    if (!prefetch.enabled)
+        return;
+
+    int start = 0, end;
+    while (start < len && (buf[start] == ' ' || buf[start] == '\t'))
+        start++;
+    for (end = start; end < len && buf[end] != ' ' && buf[end] != '\t'; end++)
+        ;
+
+    char word[sizeof(prefetch.name)] = "";
+    if (end < len && end > start && end - start < sizeof(word))
+    {
+        memcpy(word, buf + start, end - start);
+        word[end - start] = 0;
+        if (strchr(word, '/') || find_builtin(word))
+            word[0] = 0;
+    }
+    prefetch_request(word);
+}
+
+/**
+ * Prompt a command from the user
+ * @param  buf      [description]
+ * @param  buf_size [description]
+ * @return          [description]
+ */
+int prompt(struct command_t *command)
+{
+    int index = 0;
+    int c;
+    char buf[4096];
+    char saved[4096]; // the line being typed while walking the history
+    unsigned long long start = stats_begin();
+
+    terminal_raw();
+
+    show_prompt();
+    int multicode_state = 0;
+    buf[0] = 0;
+
+    int position = history_end(); // history entry shown, history_end() is the typed line
+    bool searching = false, auto_complete = false;
+    char query[256];
+    int query_len = 0, match = -1;
+
+    while (1)
+    {
+        prefetch_line(buf, index);
+        if (!input_pending())
+            render_flush(); // one write per screen update
+        c = input_getchar();
+        // printf("Keycode: %u\n", c); // DEBUG: uncomment for debugging
+
+        if (c == EOF)
+            return EXIT;
+
+        if (searching) // Ctrl+R reverse search
+        {
+            if (c == 18 || c == 127 || (c >= 32 && c < 127))
+            {
+                if (c == 18) // next older match
+                {
+                    int older = match >= 0 ? history_search(query, match) : -1;
+                    if (older >= 0)
+                        match = older;
+                }
+                else
+                {
+                    if (c == 127 && query_len > 0)
+                        query[--query_len] = 0;
+                    else if (c != 127 && query_len < sizeof(query) - 1)
+                    {
+                        query[query_len++] = c;
+                        query[query_len] = 0;
+                    }
+                    match = query_len ? history_search(query, history_end()) : -1;
+                }
+                show_search(query, match);
+                continue;
+            }
+
+            // Any other key leaves the search with the match as the line.
+            // Ctrl+G leaves it without.
+            searching = false;
+            render_append("\r\033[K", 4);
+            show_prompt();
+            index = prompt_replace(buf, 0, c == 7 || match < 0 ? saved : history_get(match), sizeof(buf));
+            if (c == 7)
+                continue;
+        }
+
+        if (c == 18) // Ctrl+R
+        {
+            buf[index] = 0;
+            strcpy(saved, buf);
+            searching = true;
+            query_len = 0;
+            query[0] = 0;
+            match = -1;
+            show_search(query, match);
+            continue;
+        }
+
+        if (c == 9) // handle tab, the line is not changed so a '?' in it stays a pattern
+        {
+            auto_complete = true;
+            break;
+        }
+
+        if (c == 127) // handle backspace
+        {
+            if (index > 0)
+            {
+                prompt_backspace();
+                index--;
+            }
+            continue;
+        }
+        if (c == 27 && multicode_state == 0) // handle multi-code keys
+        {
+            multicode_state = 1;
+            continue;
+        }
+        if (c == 91 && multicode_state == 1)
+        {
+            multicode_state = 2;
+            continue;
+        }
+        if ((c == 65 || c == 66) && multicode_state == 2) // up and down arrows
+        {
+            multicode_state = 0;
+            int next = c == 65 ? position - 1 : position + 1;
+            if (next < history_end() - history.count || next > history_end())
+                continue;
+
+            if (position == history_end())
+            {
+                buf[index] = 0;
+                strcpy(saved, buf);
+            }
+            position = next;
+            index = prompt_replace(buf, index, position == history_end() ? saved : history_get(position), sizeof(buf));
+            continue;
+        }
+        else
+            multicode_state = 0;
+        buf[index] = c;
+        render_append(&buf[index++], 1); // echo the character
+
+        if (index >= sizeof(buf) - 1)
+            break;
+        if (c == '\n') // enter key
+            break;
+        if (c == 4) // Ctrl+D
+        {
+            render_flush();
+            return EXIT;
+        }
+    }
+    render_flush();
+    if (index > 0 && buf[index - 1] == '\n') // trim newline from the end
+        index--;
+    buf[index++] = 0; // null terminate string
+
+    history_add(buf);
+    stats_phase(PHASE_PROMPT, NULL, start);
+
+    start = stats_begin();
+    parse_command(buf, command);
+    command->auto_complete = auto_complete;
+    stats_phase(PHASE_PARSE, command->name, start);
+
+    // print_command(command); // DEBUG: uncomment for debugging
+
+    return SUCCESS;
+}
+
+int process_command(struct command_t *command);
+char* find_path(char *command_name);
+void search_file(char *file, char *dir_name, char *option, char *file_list[]);
+int search_file_uring(char *file, char *dir_name, bool recursive, char *file_list[], unsigned int queue_depth);
+void add_file(char *file_list[], const char *dir_name, const char *name);
+void print_files(char *file_list[], size_t size);
+void open_files(char *file_list[], size_t size);
+void append_history_file();
+void read_print_history();
+void show_todo();
+void add_todo();
+void remove_todo();
+void todo_close();
+struct flags;
+void dircache_command(const char *command, struct flags *flags);
+void pstraverse(struct command_t *command, struct flags *flags);
+int pstraverse_proc(pid_t root, char mode, int max_depth, const char *prefix, const char *match, long uid, int max_records);
+int serve_main(const char *socket_path);
+
+int main(int argc, char *argv[])
+{
+    getcwd(cdh_file, sizeof(cdh_file));
+    strcat(cdh_file, "/cdh_history.txt");
+
+    getcwd(todo_file, sizeof(todo_file));
+    strcat(todo_file, "/todo_list.log");
+
+    getcwd(history_file, sizeof(history_file));
+    strcat(history_file, "/.shellfyre_history");
+
+    if (argc == 3 && strcmp(argv[1], "--serve") == 0)
+        return serve_main(argv[2]);
+
+    prompt_init();
+    terminal_init();
+    stats_init();
+    prefetch_init();
+
+    while (1)
+    {
+        alloc_profile_begin();
+        struct command_t *command = malloc(sizeof(struct command_t));
+        memset(command, 0, sizeof(struct command_t)); // set all bytes to 0
+
+        int code;
+        code = prompt(command);
+        if (code == EXIT)
+        {
+            free_command(command);
+            break;
+        }
+
+        code = process_command(command);
+        char name[32];
+        snprintf(name, sizeof(name), "%s", command->name);
+        free_command(command);
+        alloc_profile_end(name);
+        if (code == EXIT)
+            break;
+    }
+
+    terminal_cooked();
+    todo_close();
+    if (stats.trace)
+        fclose(stats.trace);
+    printf("\n");
+    return 0;
+}
+
+// Option of a builtin. Options with a value take the next argument.
+struct flag_spec
+{
+    const char *name;
+    bool has_value;
+};
+
+#define MAX_FLAGS 16
+#define MAX_POSITIONAL 32
+
+// Arguments of a builtin after its options are parsed.
+struct flags
+{
+    unsigned int set; // bit i is set if spec[i] was given
+    const char *values[MAX_FLAGS];
+    int positional_count;
+    char *positional[MAX_POSITIONAL];
+};
+
+// Descriptor of a builtin command.
+struct builtin
+{
+    const char *name;
+    int (*handler)(struct command_t *command, struct flags *flags);
+    const struct flag_spec *flags; // terminated by an entry without a name
+    bool cooked; // reads the terminal or runs other programs on it
+};
+
+int builtin_exit(struct command_t *command, struct flags *flags);
+int builtin_cd(struct command_t *command, struct flags *flags);
+int builtin_filesearch(struct command_t *command, struct flags *flags);
+int builtin_cdh(struct command_t *command, struct flags *flags);
+int builtin_take(struct command_t *command, struct flags *flags);
+int builtin_joker(struct command_t *command, struct flags *flags);
+int builtin_todo(struct command_t *command, struct flags *flags);
+int builtin_pstraverse(struct command_t *command, struct flags *flags);
+int builtin_stats(struct command_t *command, struct flags *flags);
+int builtin_memstats(struct command_t *command, struct flags *flags);
+
+static const struct flag_spec no_flags[] = {{NULL}};
+
+enum filesearch_flags
+{
+    FILESEARCH_RECURSIVE,
+    FILESEARCH_OPEN,
+    FILESEARCH_BACKEND,
+    FILESEARCH_QUEUE,
+    FILESEARCH_CACHE,
+};
+
+static const struct flag_spec filesearch_flags[] = {
+    [FILESEARCH_RECURSIVE] = {"-r", false},
+    [FILESEARCH_OPEN] = {"-o", false},
+    [FILESEARCH_BACKEND] = {"-backend", true},
+    [FILESEARCH_QUEUE] = {"-queue", true},
+    [FILESEARCH_CACHE] = {"--cache", true},
+    {NULL},
+};
+
+enum pstraverse_flags
+{
+    PSTRAVERSE_DFS,
+    PSTRAVERSE_BFS,
+    PSTRAVERSE_AGGREGATE,
+    PSTRAVERSE_DEPTH,
+    PSTRAVERSE_PREFIX,
+    PSTRAVERSE_MATCH,
+    PSTRAVERSE_UID,
+    PSTRAVERSE_MAX,
+    PSTRAVERSE_BACKEND,
+};
+
+static const struct flag_spec pstraverse_flags[] = {
+    [PSTRAVERSE_DFS] = {"-d", false},
+    [PSTRAVERSE_BFS] = {"-b", false},
+    [PSTRAVERSE_AGGREGATE] = {"-a", false},
+    [PSTRAVERSE_DEPTH] = {"-depth", true},
+    [PSTRAVERSE_PREFIX] = {"-prefix", true},
+    [PSTRAVERSE_MATCH] = {"-match", true},
+    [PSTRAVERSE_UID] = {"-uid", true},
+    [PSTRAVERSE_MAX] = {"-max", true},
+    [PSTRAVERSE_BACKEND] = {"-backend", true},
+    {NULL},
+};
+
+// The builtin table is indexed by a hash of the length and the first and last
+// characters of the name, which is collision free for the names below. The
+// slots are computed at compile time and the Makefile builds with
+// -Werror=override-init, so a new builtin that collides fails the build and the
+// multipliers have to be changed. A lookup is one hash and one strcmp, no
+// matter how many builtins there are.
+#define BUILTIN_TABLE_SIZE 32
+#define BUILTIN_HASH(len, first, last) ((((len) * 2) + ((first) * 2) + (last)) & (BUILTIN_TABLE_SIZE - 1))
+#define BUILTIN(name, first, last, handler, flags, cooked) \
+    [BUILTIN_HASH(sizeof(name) - 1, first, last)] = {name, handler, flags, cooked}
+
+static const struct builtin builtins[BUILTIN_TABLE_SIZE] = {
+    BUILTIN("exit", 'e', 't', builtin_exit, no_flags, true),
+    BUILTIN("cd", 'c', 'd', builtin_cd, no_flags, false),
+    BUILTIN("filesearch", 'f', 'h', builtin_filesearch, filesearch_flags, true),
+    BUILTIN("cdh", 'c', 'h', builtin_cdh, no_flags, true),
+    BUILTIN("take", 't', 'e', builtin_take, no_flags, false),
+    BUILTIN("joker", 'j', 'r', builtin_joker, no_flags, true),
+    BUILTIN("todo", 't', 'o', builtin_todo, no_flags, true),
+    BUILTIN("pstraverse", 'p', 'e', builtin_pstraverse, pstraverse_flags, true),
+    BUILTIN("stats", 's', 's', builtin_stats, no_flags, false),
+    BUILTIN("memstats", 'm', 's', builtin_memstats, no_flags, false),
+};
+
+// Latency of each builtin, at the slot of the builtin in the table.
+static struct histogram builtin_latency[BUILTIN_TABLE_SIZE];
+
+/**
+ * Find the builtin with the given name
+ * @param  name [description]
+ * @return      the descriptor, or NULL if it is not a builtin
+ */
+const struct builtin *find_builtin(const char *name)
+{
+    size_t len = strlen(name);
+    if (len == 0)
+        return NULL;
+
+    const struct builtin *builtin = &builtins[BUILTIN_HASH(len, (unsigned char)name[0], (unsigned char)name[len - 1])];
+    if (builtin->name == NULL || strcmp(builtin->name, name) != 0)
+        return NULL;
+    return builtin;
+}
+
+/**
+ * Split the arguments of a builtin into options and positional arguments
+ * @param  command [description]
+ * @param  spec    options accepted by the builtin
+ * @param  flags   parsed arguments
+ * @return         0, or -1 after printing an error
+ */
+int parse_flags(struct command_t *command, const struct flag_spec *spec, struct flags *flags)
+{
+    memset(flags, 0, sizeof(struct flags));
+
+    for (int i = 0; i < command->arg_count; i++)
+    {
+        char *arg = command->args[i];
+        int f = -1;
+
+        if (arg[0] == '-' && arg[1] != 0)
+        {
+            for (f = 0; spec[f].name; f++)
+                if (strcmp(spec[f].name, arg) == 0)
+                    break;
+            if (spec[f].name == NULL)
+            {
+                printf("-%s: %s: unknown option %s\n", sysname, command->name, arg);
+                return -1;
+            }
+        }
+
+        if (f < 0)
+        {
+            if (flags->positional_count == MAX_POSITIONAL)
+            {
+                printf("-%s: %s: too many arguments\n", sysname, command->name);
+                return -1;
+            }
+            flags->positional[flags->positional_count++] = arg;
+            continue;
+        }
+
+        flags->set |= 1u << f;
+        if (spec[f].has_value)
+        {
+            if (i + 1 == command->arg_count)
+            {
+                printf("-%s: %s: option %s needs a value\n", sysname, command->name, arg);
+                return -1;
+            }
+            flags->values[f] = command->args[++i];
+        }
+    }
+
+    return 0;
+}
+
+int process_command(struct command_t *command)
+{
+    if (strcmp(command->name, "") == 0)
+        return SUCCESS;
+
+    const struct builtin *builtin = find_builtin(command->name);
+    if (builtin)
+    {
+        struct flags flags;
+        if (parse_flags(command, builtin->flags, &flags) != 0)
+            return SUCCESS;
+        if (builtin->cooked)
+            terminal_cooked();
+        unsigned long long start = stats_begin();
+        int code = builtin->handler(command, &flags);
+        stats_end(&builtin_latency[builtin - builtins], "builtin", builtin->name, start);
+        last_status = code == UNKNOWN;
+        return code;
+    }
+
+    unsigned long long start = stats_begin();
+    char *path = find_path(command->name);
+    stats_phase(PHASE_RESOLVE, command->name, start);
+    if (path == NULL)
+    {
+        printf("-%s: %s: command not found\n", sysname, command->name);
+        last_status = 127;
+        return UNKNOWN;
+    }
+
+    // The write end of the pipe is closed by a successful execv() in the child,
+    // or by its exit, which ends the exec phase.
+    int exec_pipe[2] = {-1, -1};
+    if (stats.enabled && pipe2(exec_pipe, O_CLOEXEC) != 0)
+        exec_pipe[0] = exec_pipe[1] = -1;
+
+    terminal_cooked();
+    fflush(stdout);
+    if (stats.trace)
+        fflush(stats.trace);
+
+    start = stats_begin();
+    pid_t pid = fork();
+
+    if (pid == 0) // child
+    {
+        if (exec_pipe[0] >= 0)
+            close(exec_pipe[0]);
+
+        // increase args size by 2
+        command->args = (char **)realloc(
+                command->args, sizeof(char *) * (command->arg_count += 2));
+
+        // shift everything forward by 1
+        for (int i = command->arg_count - 2; i > 0; --i)
+            command->args[i] = command->args[i - 1];
+
+        // set args[0] as a copy of name
+        command->args[0] = strdup(command->name);
+        // set args[arg_count-1] (last) to NULL
+        command->args[command->arg_count - 1] = NULL;
+
+        execv(path, command->args);
+        printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+        exit(127);
+    }
+
+    free(path);
+    if (exec_pipe[1] >= 0)
+    {
+        close(exec_pipe[1]);
+        char byte;
+        while (read(exec_pipe[0], &byte, 1) < 0 && errno == EINTR)
+            ;
+        close(exec_pipe[0]);
+    }
+
+    if (pid < 0)
+    {
+        printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+        last_status = 126;
+        return UNKNOWN;
+    }
+    stats_phase(PHASE_EXEC, command->name, start);
+
+    last_status = 0;
+    if (!command->background)
+    {
+        int status;
+        waitpid(pid, &status, 0);
+        stats_phase(PHASE_CHILD, command->name, start);
+        last_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    }
+
+    return SUCCESS;
+}
+
+int builtin_exit(struct command_t *command, struct flags *flags) {
+    if (module_inserted) {
+        // Remove the kernel module, if it is inserted.
+        char *path = find_path("sudo");
+        char *args[] = {"sudo", "rmmod", "pstraverse.ko", NULL};
+        execv(path, args);
+    }
+    return EXIT;
+}
+
+int builtin_cd(struct command_t *command, struct flags *flags) {
+    const char *dir = flags->positional_count > 0 ? flags->positional[0] : getenv("HOME");
+
+    if (dir == NULL || chdir(dir) == -1) {
+        printf("-%s: %s: %s\n", sysname, command->name, strerror(dir ? errno : ENOENT));
+    } else {
+        append_history_file();
+        prompt_refresh_cwd();
+    }
+
+    return SUCCESS;
+}
+
+// Filesearch command. "-backend uring" batches the directory lookups through
+// io_uring with "-queue N" of them in flight, and falls back to the walker
+// below if io_uring is not available. "--cache" manages the listings the
+// walker below keeps between searches.
+int builtin_filesearch(struct command_t *command, struct flags *flags) {
+    const char *backend = flags->values[FILESEARCH_BACKEND];
+    if (flags->values[FILESEARCH_CACHE]) {
+        dircache_command(flags->values[FILESEARCH_CACHE], flags);
+        return SUCCESS;
+    }
+    if (flags->positional_count != 1 || (backend && strcmp(backend, "uring") != 0 && strcmp(backend, "sync") != 0)) {
+        printf("Usage: filesearch [-r] [-o] [-backend sync|uring] [-queue N] <name>\n");
+        printf("       filesearch --cache stats|clear|limit <MB>\n");
+        return SUCCESS;
+    }
+
+    int size = FILE_LIST_SIZE;
+    char *file_list[size];
+    for (int i = 0; i < size; i++) {
+        file_list[i] = no_file;
+    }
+
+    bool recursive = flags->set & (1u << FILESEARCH_RECURSIVE);
+    int queue_depth = flags->values[FILESEARCH_QUEUE] ? atoi(flags->values[FILESEARCH_QUEUE]) : FILESEARCH_QUEUE_DEPTH;
+    if (backend == NULL || strcmp(backend, "uring") != 0
+        || search_file_uring(flags->positional[0], ".", recursive, file_list, queue_depth > 0 ? queue_depth : FILESEARCH_QUEUE_DEPTH) != 0) {
+        search_file(flags->positional[0], ".", recursive ? "r" : NULL, file_list);
+    }
+    print_files(file_list, size);
+    if (flags->set & (1u << FILESEARCH_OPEN)) {
+        open_files(file_list, size);
+    }
+
+    for (int i = 0; i < size && file_list[i] != no_file; i++) {
+        free(file_list[i]);
+    }
+
+    return SUCCESS;
+}
+
+// cdh command
+int builtin_cdh(struct command_t *command, struct flags *flags) {
+    read_print_history();
+    append_history_file();
+    prompt_refresh_cwd();
+    return SUCCESS;
+}
+
+int builtin_take(struct command_t *command, struct flags *flags) {
+    if (flags->positional_count == 1) {
+        // Tokenize the string and create the directories, if they don't exist.
+        char *token = strtok(flags->positional[0], "/");
+
+        while (token != NULL) {
+            mkdir(token, 0700);
+            chdir(token);
+            append_history_file();
+            token = strtok(NULL, "/");
+        }
+        prompt_refresh_cwd();
+    }
+
+    return SUCCESS;
+}
+
+int builtin_joker(struct command_t *command, struct flags *flags) {
+    // Create a temporary file for crontab then set the cron job.
+    FILE *fp = fopen("crontab_joker.txt", "w");
+
+    fputs("*/15 * * * * XDG_RUNTIME_DIR=/run/user/$(id -u) notify-send Joke \"$(curl -s https://icanhazdadjoke.com/)\"\n", fp);
+    fclose(fp);
+
+    char *args[] = {"crontab", "crontab_joker.txt", NULL};
+    char *path = find_path("crontab");
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        execv(path, args);
+    } else {
+        wait(NULL);
+    }
+
+    free(path);
+    remove("crontab_joker.txt");
+
+    return SUCCESS;
+}
+
+// My own command -> Author: Kemal Bora Bayraktar
+// This command shows the todo list.
+int builtin_todo(struct command_t *command, struct flags *flags) {
+    if (flags->positional_count == 0) {
+        show_todo();
+    } else if (flags->positional_count == 1) {
+        if (strcmp(flags->positional[0], "add") == 0) {
+            add_todo();
+        } else if (strcmp(flags->positional[0], "remove") == 0) {
+            remove_todo();
+        }
+    }
+
+    return SUCCESS;
+}
+
+int builtin_pstraverse(struct command_t *command, struct flags *flags) {
+    pstraverse(command, flags);
+    return SUCCESS;
+}
+
+// Prints the latency of every phase and builtin since the last call and
+// resets them. `stats on` and `stats off` turn the measurements on and off.
+int builtin_stats(struct command_t *command, struct flags *flags) {
+    if (flags->positional_count == 1 && (strcmp(flags->positional[0], "on") == 0 || strcmp(flags->positional[0], "off") == 0)) {
+        stats.enabled = strcmp(flags->positional[0], "on") == 0;
+        return SUCCESS;
+    }
+    if (!stats.enabled) {
+        printf("Statistics are off, turn them on with `stats on` or SHELLFYRE_STATS=1.\n");
+        return SUCCESS;
+    }
+
+    printf("%-12s %8s %12s %12s %12s\n", "phase", "count", "p50 (us)", "p99 (us)", "max (us)");
+    for (int i = 0; i < PHASE_COUNT; i++)
+        stats_print(phase_names[i], &stats.phases[i]);
+    for (int i = 0; i < BUILTIN_TABLE_SIZE; i++)
+        if (builtins[i].name)
+            stats_print(builtins[i].name, &builtin_latency[i]);
+
+    memset(stats.phases, 0, sizeof(stats.phases));
+    memset(builtin_latency, 0, sizeof(builtin_latency));
+    return SUCCESS;
+}
+
+int builtin_memstats(struct command_t *command, struct flags *flags) {
+#ifdef SHELLFYRE_ALLOC_PROFILE
+    if (flags->positional_count == 1 && strcmp(flags->positional[0], "reset") == 0)
+        alloc_profile_reset();
+    else
+        alloc_profile_print();
+#else
+    printf("Allocation profiling is not built in, build with -DSHELLFYRE_ALLOC_PROFILE.\n");
+#endif
+    return SUCCESS;
+}
+
+// Function to find the path of a command.
+char* find_path(char *command_name) {
+
+    char PATH[1024];
+    snprintf(PATH, sizeof(PATH), "%s", getenv("PATH") ? getenv("PATH") : "");
+
+    // strtok_r(), the prefetch thread resolves names too.
+    char *saveptr;
+    char *token = strtok_r(PATH, ":", &saveptr);
+    struct stat file_properties;
+
+    char command_path[PATH_MAX];
+    while (token != NULL) {
+        snprintf(command_path, sizeof(command_path), "%s/%s", token, command_name);
+
+        int exists = stat(command_path, &file_properties);
+
+        if ((exists == 0) && (file_properties.st_mode & S_IXUSR)) {
+            return strdup(command_path);
+        }
+
+        token = strtok_r(NULL, ":", &saveptr);
+    }
+
+    return NULL;
+}
+
+// This function finds the files that contains a certain string in a given directory.
+// Stores dir_name/name in the first free slot of file_list. Matches past the
+// size of the list are dropped.
+void add_file(char *file_list[], const char *dir_name, const char *name) {
+    int index = 0;
+    while (index < FILE_LIST_SIZE - 1 && strcmp(file_list[index], "") != 0) {
+        index++;
+    }
+    if (index == FILE_LIST_SIZE - 1)
+        return;
+
+    int size = strlen(dir_name) + strlen(name) + 2;
+    char *temp = (char *) malloc(size);
+    snprintf(temp, size, "%s/%s", dir_name, name);
+
+    if (file_list[index] != no_file)
+        free(file_list[index]);
+    file_list[index] = temp;
+}
+
+// Directory listings (names and types) of earlier searches. A listing is
+// keyed by the device and inode of its directory and used again while the
+// mtime and ctime of the directory are unchanged, which costs one fstatat()
+// instead of reading the directory. A directory changed within the last
+// second is not cached: a change in the same tick of the file system clock
+// would not change its mtime, and neither is a listing larger than the limit
+// of the cache. The least recently used listings are dropped
+// when the cache holds more than its limit, SHELLFYRE_DIRCACHE_MB (64 MB by
+// default) or `filesearch --cache limit <MB>`.
+#define DIRCACHE_DEFAULT_MB 64
+
+struct dir_listing
+{
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime, ctime;
+    char *entries; // type byte, name, NUL, repeated
+    size_t size;
+    int pins; // searches iterating the listing
+    bool cached;
+    struct dir_listing *hash_next;
+    struct dir_listing *lru_prev, *lru_next; // most recently used first
+};
+
+struct dircache
+{
+    bool loaded;
+    size_t limit, used;
+    struct dir_listing **buckets;
+    size_t bucket_count, count;
+    struct dir_listing *lru_first, *lru_last;
+    unsigned long hits, misses, uncacheable, evictions;
+};
+
+static struct dircache dircache;
+
+static size_t dircache_bucket(dev_t dev, ino_t ino)
+{
+    return (ino * 0x9E3779B97F4A7C15ULL ^ dev) & (dircache.bucket_count - 1);
+}
+
+static void dircache_unlink(struct dir_listing *listing)
+{
+    struct dir_listing **link = &dircache.buckets[dircache_bucket(listing->dev, listing->ino)];
+    while (*link != listing)
+        link = &(*link)->hash_next;
+    *link = listing->hash_next;
+
+    if (listing->lru_prev)
+        listing->lru_prev->lru_next = listing->lru_next;
+    else
+        dircache.lru_first = listing->lru_next;
+    if (listing->lru_next)
+        listing->lru_next->lru_prev = listing->lru_prev;
+    else
+        dircache.lru_last = listing->lru_prev;
+
+    listing->cached = false;
+    dircache.used -= sizeof(*listing) + listing->size;
+    dircache.count--;
+}
+
+static void dircache_free(struct dir_listing *listing)
+{
+    free(listing->entries);
+    free(listing);
+}
+
+// Drops least recently used listings until the cache fits in its limit.
+static void dircache_evict(size_t limit)
+{
+    struct dir_listing *listing = dircache.lru_last;
+    while (listing && dircache.used > limit)
+    {
+        struct dir_listing *prev = listing->lru_prev;
+        if (listing->pins == 0)
+        {
+            dircache_unlink(listing);
+            dircache_free(listing);
+            dircache.evictions++;
+        }
+        listing = prev;
+    }
+}
+
+static void dircache_insert(struct dir_listing *listing)
+{
+    if (dircache.count >= dircache.bucket_count)
+    {
+        size_t old_count = dircache.bucket_count;
+        struct dir_listing **old = dircache.buckets;
+        dircache.bucket_count = old_count ? old_count * 2 : 1024;
+        dircache.buckets = calloc(dircache.bucket_count, sizeof(struct dir_listing *));
+        for (size_t i = 0; i < old_count; i++)
+        {
+            for (struct dir_listing *next, *entry = old[i]; entry; entry = next)
+            {
+                next = entry->hash_next;
+                size_t bucket = dircache_bucket(entry->dev, entry->ino);
+                entry->hash_next = dircache.buckets[bucket];
+                dircache.buckets[bucket] = entry;
+            }
+        }
+        free(old);
+    }
+
+    size_t bucket = dircache_bucket(listing->dev, listing->ino);
+    listing->hash_next = dircache.buckets[bucket];
+    dircache.buckets[bucket] = listing;
+    listing->lru_prev = NULL;
+    listing->lru_next = dircache.lru_first;
+    if (dircache.lru_first)
+        dircache.lru_first->lru_prev = listing;
+    else
+        dircache.lru_last = listing;
+    dircache.lru_first = listing;
+    listing->cached = true;
+    dircache.used += sizeof(*listing) + listing->size;
+    dircache.count++;
+    dircache_evict(dircache.limit);
+}
+
+static void dircache_load()
+{
+    if (dircache.loaded)
+        return;
+    dircache.loaded = true;
+
+    const char *limit = getenv("SHELLFYRE_DIRCACHE_MB");
+    dircache.limit = (size_t)(limit && atoi(limit) >= 0 ? atoi(limit) : DIRCACHE_DEFAULT_MB) << 20;
+}
+
+// Reads a directory into a new listing.
+static struct dir_listing *dircache_read(const char *dir_name)
+{
+    DIR *dir = opendir(dir_name);
+    if (dir == NULL)
+        return NULL;
+
+    struct dir_listing *listing = calloc(1, sizeof(struct dir_listing));
+    size_t capacity = 4096;
+    listing->entries = malloc(capacity);
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        size_t len = strlen(entry->d_name) + 2;
+        if (listing->size + len > capacity)
+        {
+            capacity = (listing->size + len) * 2;
+            listing->entries = realloc(listing->entries, capacity);
+        }
+        listing->entries[listing->size] = entry->d_type;
+        memcpy(listing->entries + listing->size + 1, entry->d_name, len - 1);
+        listing->size += len;
+    }
+    closedir(dir);
+    listing->entries = realloc(listing->entries, listing->size ? listing->size : 1);
+    return listing;
+}
+
+// Returns true if the directory was last changed at least a second ago, to
+// the nanosecond.
+static bool dircache_stable(const struct stat *st)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    long long ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+    return ns - (st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec) >= 1000000000LL
+        && ns - (st->st_ctim.tv_sec * 1000000000LL + st->st_ctim.tv_nsec) >= 1000000000LL;
 }
 
 /**
- * Prompt a command from the user
- * @param  buf      [description]
- * @param  buf_size [description]
- * @return          [description]
+ * Returns the listing of a directory, from the cache if it is unchanged
+ * @param  dir_name directory to list
+ * @return          NULL if the directory cannot be read, to be released
+ *                  with dircache_put()
  */
-int prompt(struct command_t *command)
+struct dir_listing *dircache_get(const char *dir_name)
 {
-    int index = 0;
-    char c;
-    char buf[4096];
-    static char oldbuf[4096];
+    struct stat st;
+    dircache_load();
+    if (dircache.limit == 0 || fstatat(AT_FDCWD, dir_name, &st, 0) != 0)
+        return dircache_read(dir_name);
 
-    // tcgetattr gets the parameters of the current terminal
-    // STDIN_FILENO will tell tcgetattr that it should write the settings
-    // of stdin to oldt
-    static struct termios backup_termios, new_termios;
-    tcgetattr(STDIN_FILENO, &backup_termios);
-    new_termios = backup_termios;
-    // ICANON normally takes care that one line at a time will be processed
-    // that means it will return if it sees a "\n" or an EOF or an EOL
-    new_termios.c_lflag &= ~(ICANON | ECHO); // Also disable automatic echo. We manually echo each char.
-    // Those new settings will be set to STDIN
-    // TCSANOW tells tcsetattr to change attributes immediately.
-    tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
+    struct dir_listing *listing = dircache.bucket_count ? dircache.buckets[dircache_bucket(st.st_dev, st.st_ino)] : NULL;
+    while (listing && (listing->dev != st.st_dev || listing->ino != st.st_ino))
+        listing = listing->hash_next;
 
-    // FIXME: backspace is applied before printing chars
-    show_prompt();
-    int multicode_state = 0;
-    buf[0] = 0;
+    if (listing && listing->mtime.tv_sec == st.st_mtim.tv_sec && listing->mtime.tv_nsec == st.st_mtim.tv_nsec
+        && listing->ctime.tv_sec == st.st_ctim.tv_sec && listing->ctime.tv_nsec == st.st_ctim.tv_nsec)
+    {
+        dircache.hits++;
+        if (listing != dircache.lru_first) // move to the front
+        {
+            listing->lru_prev->lru_next = listing->lru_next;
+            if (listing->lru_next)
+                listing->lru_next->lru_prev = listing->lru_prev;
+            else
+                dircache.lru_last = listing->lru_prev;
+            listing->lru_prev = NULL;
+            listing->lru_next = dircache.lru_first;
+            dircache.lru_first->lru_prev = listing;
+            dircache.lru_first = listing;
+        }
+        listing->pins++;
+        return listing;
+    }
+
+    dircache.misses++;
+    if (listing) // changed since it was cached, freed by the last dircache_put() if pinned
+    {
+        dircache_unlink(listing);
+        if (listing->pins == 0)
+            dircache_free(listing);
+    }
+
+    listing = dircache_read(dir_name);
+    if (listing == NULL)
+        return NULL;
+    listing->pins = 1;
+
+    // A directory changed less than a second ago can change again within the
+    // same tick of the file system clock and keep its times, so it is not
+    // kept. A listing larger than the whole cache would only push out the others.
+    if (!dircache_stable(&st) || sizeof(*listing) + listing->size > dircache.limit)
+    {
+        dircache.uncacheable++;
+        return listing;
+    }
+
+    listing->dev = st.st_dev;
+    listing->ino = st.st_ino;
+    listing->mtime = st.st_mtim;
+    listing->ctime = st.st_ctim;
+    dircache_insert(listing);
+    return listing;
+}
+
+void dircache_put(struct dir_listing *listing)
+{
+    listing->pins--;
+    if (!listing->cached && listing->pins <= 0)
+        dircache_free(listing);
+}
+
+// filesearch --cache stats|clear|limit <MB>
+void dircache_command(const char *command, struct flags *flags)
+{
+    dircache_load();
+    if (strcmp(command, "stats") == 0)
+    {
+        printf("%zu directories, %.1f of %.1f MB\n", dircache.count, dircache.used / 1048576.0, dircache.limit / 1048576.0);
+        printf("%lu hits, %lu misses, %lu changed too recently or too large to cache, %lu evictions\n",
+               dircache.hits, dircache.misses, dircache.uncacheable, dircache.evictions);
+    }
+    else if (strcmp(command, "clear") == 0)
+    {
+        dircache_evict(0);
+        dircache.hits = dircache.misses = dircache.uncacheable = dircache.evictions = 0;
+    }
+    else if (strcmp(command, "limit") == 0 && flags->positional_count == 1 && atoi(flags->positional[0]) >= 0)
+    {
+        dircache.limit = (size_t)atoi(flags->positional[0]) << 20;
+        dircache_evict(dircache.limit);
+    }
+    else
+        printf("Usage: filesearch --cache stats|clear|limit <MB>\n");
+}
+
+void search_file(char *file, char *dir_name, char *option, char *file_list[]) {
+    struct dir_listing *listing = dircache_get(dir_name);
+
+    if (listing) {
+        for (size_t pos = 0; pos < listing->size; pos += strlen(listing->entries + pos + 1) + 2) {
+            unsigned char d_type = listing->entries[pos];
+            const char *d_name = listing->entries + pos + 1;
+
+            if (strstr(d_name, file) && d_type == DT_REG) {
+                add_file(file_list, dir_name, d_name);
+            }
+
+            if (option != NULL && strcmp(option, "r") == 0) {
+                if (d_type == DT_DIR) {
+                    char path[1024];
+
+                    if (strcmp(d_name, ".") == 0 || strcmp(d_name, "..") == 0)
+                        continue;
+
+                    snprintf(path, sizeof(path), "%s/%s", dir_name, d_name);
+                    search_file(file, path, "r", file_list);
+                }
+            }
+
+        }
+        dircache_put(listing);
+    }
+}
+// io_uring backend of filesearch. Directories are opened through a ring with
+// up to queue_depth openat requests in flight (and statx requests, for file
+// systems that do not report the type of an entry), so the lookups of many
+// directories overlap on a cold cache. io_uring has no getdents operation:
+// the entries of an opened directory are read with getdents64() while the
+// other requests proceed in the kernel.
+struct uring
+{
+    int fd;
+    unsigned int entries;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_size, cq_size;
+};
+
+static int uring_init(struct uring *ring, unsigned int entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+        return -1;
+
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    ring->entries = params.sq_entries;
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (single_mmap && ring->cq_size > ring->sq_size)
+        ring->sq_size = ring->cq_size;
+
+    ring->sq_ring = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = single_mmap ? ring->sq_ring
+        : mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+
+    char *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_head = (unsigned int *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned int *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    return 0;
+}
+
+static void uring_exit(struct uring *ring) {
+    munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+    if (ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_size);
+    munmap(ring->sq_ring, ring->sq_size);
+    close(ring->fd);
+}
+
+// Returns the next submission entry, cleared. The caller keeps the number of
+// requests in flight at most the size of the ring.
+static struct io_uring_sqe *uring_sqe(struct uring *ring) {
+    unsigned int tail = *ring->sq_tail;
+    unsigned int index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+// Returns true if the kernel implements all of the operations. Kernels older
+// than the probe do not have openat and statx in io_uring either.
+static bool uring_supports(struct uring *ring, const int *ops, int count) {
+    struct io_uring_probe *probe = calloc(1, sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op));
+    bool supported = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+
+    for (int i = 0; supported && i < count; i++)
+        supported = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return supported;
+}
+
+// Submits count new entries and waits for at least one completion. The kernel
+// may take fewer entries than asked, so it is entered until all of them are in.
+static int uring_submit(struct uring *ring, unsigned int count) {
+    unsigned int submitted = 0;
+    int ret;
+    do {
+        ret = syscall(__NR_io_uring_enter, ring->fd, count - submitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret > 0)
+            submitted += ret;
+    } while ((ret < 0 && errno == EINTR) || (ret > 0 && submitted < count));
+    return ret < 0 || submitted < count ? -1 : (int) submitted;
+}
+
+// Takes back the entries the kernel has not consumed, after io_uring_enter()
+// failed, and stores their user_data in slots. Returns their number.
+static unsigned int uring_withdraw(struct uring *ring, unsigned int *slots) {
+    unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned int tail = *ring->sq_tail, count = 0;
+
+    for (unsigned int i = head; i != tail; i++)
+        slots[count++] = ring->sqes[ring->sq_array[i & *ring->sq_mask]].user_data;
+    __atomic_store_n(ring->sq_tail, head, __ATOMIC_RELEASE);
+    return count;
+}
+
+enum search_ops {
+    SEARCH_OPEN, // a directory to read
+    SEARCH_STATX, // an entry of unknown type
+};
+
+struct search_request {
+    int op;
+    char *path;
+    struct statx stx;
+};
+
+// Requests waiting for a slot of the ring, oldest first.
+struct search_queue {
+    struct search_request *requests;
+    size_t head, tail, capacity;
+};
+
+static void search_push(struct search_queue *queue, int op, const char *dir_name, const char *name) {
+    if (queue->head == queue->tail)
+        queue->head = queue->tail = 0;
+    if (queue->tail == queue->capacity) {
+        queue->capacity = queue->capacity ? queue->capacity * 2 : 64;
+        queue->requests = realloc(queue->requests, sizeof(struct search_request) * queue->capacity);
+    }
+
+    struct search_request *request = &queue->requests[queue->tail++];
+    request->op = op;
+    request->path = malloc(strlen(dir_name) + strlen(name) + 2);
+    sprintf(request->path, name[0] ? "%s/%s" : "%s", dir_name, name);
+}
+
+// Sorts the entries of an opened directory into matches and new requests.
+static void search_entries(int fd, const char *dir_name, const char *file, bool recursive, char *file_list[], struct search_queue *queue) {
+    char buf[32768];
+    ssize_t len;
+
+    while ((len = getdents64(fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t pos = 0; pos < len;) {
+            struct dirent64 *entry = (struct dirent64 *) (buf + pos);
+            pos += entry->d_reclen;
+
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+                continue;
+            bool match = strstr(entry->d_name, file) != NULL;
+            if (entry->d_type == DT_REG && match)
+                add_file(file_list, dir_name, entry->d_name);
+            else if (entry->d_type == DT_DIR && recursive)
+                search_push(queue, SEARCH_OPEN, dir_name, entry->d_name);
+            else if (entry->d_type == DT_UNKNOWN && (match || recursive))
+                search_push(queue, SEARCH_STATX, dir_name, entry->d_name);
+        }
+    }
+}
+
+/**
+ * Searches like search_file(), with the requests batched through io_uring
+ * @param  queue_depth most requests in flight
+ * @return             -1 if io_uring or its openat and statx are not available,
+ *                     with file_list left empty, 0 otherwise
+ */
+int search_file_uring(char *file, char *dir_name, bool recursive, char *file_list[], unsigned int queue_depth) {
+    static const int ops[] = {IORING_OP_OPENAT, IORING_OP_STATX};
+    struct uring ring;
+    if (queue_depth == 0 || uring_init(&ring, queue_depth) != 0)
+        return -1;
+    if (!uring_supports(&ring, ops, 2)) {
+        uring_exit(&ring);
+        return -1;
+    }
+
+    // The slot of a request is its user_data.
+    unsigned int slots = ring.entries, free_count = slots, submit = 0;
+    struct search_request *requests = calloc(slots, sizeof(struct search_request));
+    unsigned int *free_slots = malloc(sizeof(unsigned int) * slots);
+    for (unsigned int i = 0; i < slots; i++)
+        free_slots[i] = i;
+
+    struct search_queue queue = {0};
+    search_push(&queue, SEARCH_OPEN, dir_name, "");
+    bool failed = false, abandoned = false;
+
+    // After a failure, only the requests in flight are waited for.
+    while (free_count < slots || (!failed && queue.head < queue.tail)) {
+        while (!failed && free_count > 0 && queue.head < queue.tail) {
+            unsigned int slot = free_slots[--free_count];
+            struct search_request *request = &requests[slot];
+            struct io_uring_sqe *sqe = uring_sqe(&ring);
+
+            *request = queue.requests[queue.head++];
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (unsigned long) request->path;
+            sqe->user_data = slot;
+            if (request->op == SEARCH_OPEN) {
+                sqe->opcode = IORING_OP_OPENAT;
+                sqe->open_flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+            } else {
+                sqe->opcode = IORING_OP_STATX;
+                sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+                sqe->len = STATX_TYPE;
+                sqe->off = (unsigned long) &request->stx;
+            }
+            submit++;
+        }
+
+        // After a failed submission the entries the kernel did not take are
+        // withdrawn and the loop only waits for the ones it did. If waiting
+        // fails too, the kernel may still write into the requests, so they
+        // are left allocated.
+        if (uring_submit(&ring, submit) < 0) {
+            if (failed) {
+                abandoned = true;
+                break;
+            }
+            failed = true;
+            free_count += uring_withdraw(&ring, free_slots + free_count);
+        }
+        submit = 0;
+
+        unsigned int head = *ring.cq_head;
+        unsigned int tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            struct search_request *request = &requests[cqe->user_data];
+
+            // The operation is rejected, by the kernel or a policy.
+            if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP)
+                failed = true;
+
+            if (request->op == SEARCH_OPEN && cqe->res >= 0) {
+                if (!failed)
+                    search_entries(cqe->res, request->path, file, recursive, file_list, &queue);
+                close(cqe->res);
+            } else if (!failed && request->op == SEARCH_STATX && cqe->res == 0) {
+                char *name = strrchr(request->path, '/');
+                *name++ = 0;
+                if (S_ISREG(request->stx.stx_mode) && strstr(name, file))
+                    add_file(file_list, request->path, name);
+                else if (S_ISDIR(request->stx.stx_mode) && recursive)
+                    search_push(&queue, SEARCH_OPEN, request->path, name);
+            }
+
+            free(request->path);
+            request->path = NULL;
+            free_slots[free_count++] = cqe->user_data;
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    uring_exit(&ring);
+    if (!abandoned) {
+        for (unsigned int i = 0; i < slots; i++)
+            free(requests[i].path);
+        free(requests);
+    }
+    for (; queue.head < queue.tail; queue.head++)
+        free(queue.requests[queue.head].path);
+    free(queue.requests);
+    free(free_slots);
+
+    // The caller searches again without io_uring.
+    if (failed) {
+        for (int i = 0; i < FILE_LIST_SIZE && file_list[i] != no_file; i++) {
+            free(file_list[i]);
+            file_list[i] = no_file;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+
+// Prints the files that have been found.
+void print_files(char *file_list[], size_t size) {
+    for (int i = 0; i < size; i++) {
+        if (strcmp(file_list[i], "") == 0) {
+            int index = i - 1;
+
+            while (index >= 0) {
+                printf("\t%s\n", file_list[index]);
+                index--;
+            }
+
+            break;
+        }
+    }
+}
+
+// Open the files with the users deafult application.
+void open_files(char *file_list[], size_t size) {
+    for (int i = 0; i < size; i++) {
+        if (strcmp(file_list[i], "") != 0) {
+            char *args[] = {"xdg-open", file_list[i], NULL};
+
+            pid_t pid = fork();
+            if (pid == 0) {
+                char *path = find_path("xdg-open");
+                execv(path, args);
+                free(path);
+            } else {
+                wait(NULL);
+            }
+        }
+    }
+}
+
+// Append the changed directory to cdh_history.txt file.
+void append_history_file() {
+    FILE *fp = fopen(cdh_file, "a+");
+
+    if (fp) {
+        char line[1024];
+        char cwd[800];
+
+        getcwd(cwd, sizeof(cwd));
+        snprintf(line, sizeof(line), "%s\n", cwd);
+        fputs(line, fp);
+    }
+
+    fclose(fp);
+}
+
+// Reads and prints cdh_history.txt, then waits for an input from the
+// user and changes to that directory.
+void read_print_history() {
+    FILE *fp = fopen(cdh_file, "r");
+    if (!fp) {
+        printf("You didn't visited any directory yet.\n");
+    } else {
+        // Only the last ten directories are shown, so only the end of the file
+        // is read. A line is at most 801 bytes, the cwd and a newline.
+        char lines[11][1024]; // the last lines read, in a ring
+        if (fseek(fp, -11 * 1024, SEEK_END) == 0)
+            fgets(lines[0], 1024, fp); // skip the partial line
+        else
+            rewind(fp);
+
+        int number_of_lines = 0;
+        while (fgets(lines[number_of_lines % 11], 1024, fp)) number_of_lines++;
+        fclose(fp);
+
+        // last_ten_dir[n] is the nth most recent directory, from 1.
+        char last_ten_dir[11][1024];
+        int number_of_dir = 1;
+        while (number_of_dir <= number_of_lines && number_of_dir <= 10) {
+            strcpy(last_ten_dir[number_of_dir], lines[(number_of_lines - number_of_dir) % 11]);
+            number_of_dir++;
+        }
+
+        const char *home = getenv("HOME");
+        int i = 0;
+        while (i < number_of_dir - 1) {
+            char output[1024];
+            strcpy(output, last_ten_dir[number_of_dir - i - 1]);
+            char *loc = home && home[0] ? strstr(output, home) : NULL;
+
+            if (loc) {
+                int n = 0;
+                while (loc[n] == home[n]) n++;
+                printf("%c %d) ~%s", 95 + number_of_dir - i, number_of_dir - i - 1, loc + n);
+            } else {
+                printf("%c %d) %s", 95 + number_of_dir - i, number_of_dir - i - 1, output);
+            }
 
-    while (1)
-    {
-        c = getchar();
-        // printf("Keycode: %u\n", c); // DEBUG: uncomment for debugging
+            i++;
+        }
 
-        if (c == 9) // handle tab
-        {
-            buf[index++] = '?'; // autocomplete
-            break;
+        char *input = NULL;
+        size_t size = 0;
+        printf("Select directory by letter or number: ");
+        if (input_getline(&input, &size) < 0) {
+            free(input);
+            return;
         }
+        input[strcspn(input, "\n")] = '\0';
 
-        if (c == 127) // handle backspace
-        {
-            if (index > 0)
-            {
-                prompt_backspace();
-                index--;
-            }
-            continue;
+        // A number from 1, or the letter printed next to it.
+        int selected = 0;
+        if (input[0] >= 'a' && input[0] <= 'z' && input[1] == '\0') {
+            selected = input[0] - 'a' + 1;
+        } else if (input[0] != '\0' && strspn(input, "0123456789") == strlen(input)) {
+            selected = atoi(input);
         }
-        if (c == 27 && multicode_state == 0) // handle multi-code keys
-        {
-            multicode_state = 1;
-            continue;
+        free(input);
+
+        if (selected >= 1 && selected < number_of_dir) {
+            char *path = last_ten_dir[selected];
+            path[strcspn(path, "\n")] = '\0';
+            chdir(path);
         }
-        if (c == 91 && multicode_state == 1)
-        {
-            multicode_state = 2;
-            continue;
+    }
+}
+
+// The todo list is an append-only log with an in-memory index of the tasks.
+// A task is stored as "+<id> <length>\n<text>\n" and removed by appending the
+// tombstone "-<id>\n", so adding and removing a task is a single write.
+// Once enough removed records pile up, a background thread rewrites the log
+// with only the live tasks and renames it over the old one.
+struct todo_record {
+    unsigned long id;
+    off_t offset;       // offset of the text in the log
+    size_t len;
+    bool live;
+};
+
+// Records are kept in id order, which is also the order of the list. A Fenwick
+// tree over the live flags maps a position of the list to its record in O(log n).
+struct todo_store {
+    int fd;
+    bool loaded;
+    bool fsync_always;
+    struct todo_record *records;
+    int *tree;
+    int slots;          // records including the removed ones
+    int capacity;       // power of two
+    int count;          // live records
+    unsigned long next_id;
+    off_t size;         // end of the log
+    int dead;           // removed tasks and tombstones still in the log
+    bool compacting;
+    bool compacted;
+    pthread_t compactor;
+    pthread_mutex_t lock;
+};
+
+static struct todo_store todo = {.fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER};
+
+#define TODO_COMPACT_MIN_DEAD 64
+
+static void todo_sync(int fd) {
+    if (todo.fsync_always)
+        fsync(fd);
+}
+
+static void todo_tree_update(int slot, int delta) {
+    for (int i = slot + 1; i <= todo.capacity; i += i & -i)
+        todo.tree[i] += delta;
+}
+
+// Rebuilds the Fenwick tree from the live flags in O(n).
+static void todo_tree_build() {
+    memset(todo.tree, 0, sizeof(int) * (todo.capacity + 1));
+    for (int i = 1; i <= todo.capacity; i++) {
+        if (i <= todo.slots && todo.records[i - 1].live)
+            todo.tree[i]++;
+        int parent = i + (i & -i);
+        if (parent <= todo.capacity)
+            todo.tree[parent] += todo.tree[i];
+    }
+}
+
+// Slot of the live record at the given 1-based position.
+static int todo_tree_find(int position) {
+    int slot = 0;
+    for (int step = todo.capacity; step > 0; step >>= 1) {
+        if (slot + step <= todo.capacity && todo.tree[slot + step] < position) {
+            slot += step;
+            position -= todo.tree[slot];
         }
-        if (c == 65 && multicode_state == 2) // up arrow
-        {
-            int i;
-            while (index > 0)
-            {
-                prompt_backspace();
-                index--;
-            }
-            for (i = 0; oldbuf[i]; ++i)
-            {
-                putchar(oldbuf[i]);
-                buf[i] = oldbuf[i];
-            }
-            index = i;
-            continue;
+    }
+    return slot;
+}
+
+static void todo_index_add(unsigned long id, off_t offset, size_t len) {
+    if (todo.slots == todo.capacity) {
+        todo.capacity = todo.capacity ? todo.capacity * 2 : 64;
+        todo.records = realloc(todo.records, sizeof(struct todo_record) * todo.capacity);
+        todo.tree = realloc(todo.tree, sizeof(int) * (todo.capacity + 1));
+        todo.records[todo.slots] = (struct todo_record) {id, offset, len, true};
+        todo.slots++;
+        todo_tree_build();
+    } else {
+        todo.records[todo.slots] = (struct todo_record) {id, offset, len, true};
+        todo_tree_update(todo.slots++, 1);
+    }
+    todo.count++;
+    if (id >= todo.next_id)
+        todo.next_id = id + 1;
+}
+
+static void todo_index_remove_slot(int slot) {
+    todo.records[slot].live = false;
+    todo_tree_update(slot, -1);
+    todo.count--;
+    todo.dead += 2;
+}
+
+// Ids only grow, so the record of a tombstone is found by binary search.
+static void todo_index_remove(unsigned long id) {
+    int low = 0, high = todo.slots - 1;
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        if (todo.records[mid].id == id) {
+            if (todo.records[mid].live)
+                todo_index_remove_slot(mid);
+            return;
         }
+        if (todo.records[mid].id < id)
+            low = mid + 1;
         else
-            multicode_state = 0;
-        putchar(c); // echo the character
+            high = mid - 1;
+    }
+}
 
-        buf[index++] = c;
-        if (index >= sizeof(buf) - 1)
-            break;
-        if (c == '\n') // enter key
-            break;
-        if (c == 4) // Ctrl+D
-            return EXIT;
+// Appends one record to the log with a single write.
+static int todo_write_record(const char *record, size_t len) {
+    ssize_t written = write(todo.fd, record, len);
+    if (written != (ssize_t) len) {
+        // Cut off a partial record, so the log stays parseable.
+        if (written > 0)
+            ftruncate(todo.fd, todo.size);
+        return -1;
     }
-    if (index > 0 && buf[index - 1] == '\n') // trim newline from the end
-        index--;
-    buf[index++] = 0; // null terminate string
+    todo_sync(todo.fd);
+    todo.size += len;
+    return 0;
+}
 
-    strcpy(oldbuf, buf);
+int todo_append(const char *text);
 
-    parse_command(buf, command);
+// Opens the log and builds the index with one sequential read. A record cut
+// short by a crash is dropped.
+static int todo_reload() {
+    if (todo.fd >= 0)
+        close(todo.fd);
+    free(todo.records);
+    free(todo.tree);
+    todo.records = NULL;
+    todo.tree = NULL;
+    todo.slots = todo.count = todo.dead = todo.capacity = 0;
 
-    // print_command(command); // DEBUG: uncomment for debugging
+    todo.fd = open(todo_file, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (todo.fd < 0)
+        return -1;
 
-    // restore the old settings
-    tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
-    return SUCCESS;
-}
+    struct stat st;
+    fstat(todo.fd, &st);
+    char *log = malloc(st.st_size + 1);
+    ssize_t n = pread(todo.fd, log, st.st_size, 0);
+    if (n < 0)
+        n = 0;
+    log[n] = 0;
 
-int process_command(struct command_t *command);
-char* find_path(char *command_name);
-void search_file(char *file, char *dir_name, char *option, char *file_list[]);
-void print_files(char *file_list[], size_t size);
-void open_files(char *file_list[], size_t size);
-void append_history_file();
-void read_print_history();
-void show_todo();
-void add_todo();
-void remove_todo();
-void pstraverse(struct command_t *command);
+    off_t pos = 0;
+    while (pos < n) {
+        unsigned long id;
+        size_t len;
+        int header;
 
-int main()
-{
-    getcwd(cdh_file, sizeof(cdh_file));
-    strcat(cdh_file, "/cdh_history.txt");
+        if (log[pos] == '+' && sscanf(log + pos, "+%lu %zu%n", &id, &len, &header) == 2
+                && log[pos + header] == '\n' && pos + header + len + 2 <= n
+                && log[pos + header + 1 + len] == '\n') {
+            todo_index_add(id, pos + header + 1, len);
+            pos += header + len + 2;
+        } else if (log[pos] == '-' && sscanf(log + pos, "-%lu%n", &id, &header) == 1
+                && log[pos + header] == '\n') {
+            todo_index_remove(id);
+            pos += header + 1;
+        } else {
+            break;
+        }
+    }
+    free(log);
 
-    getcwd(todo_file, sizeof(todo_file));
-    strcat(todo_file, "/todo_list.txt");
+    if (pos < st.st_size)
+        ftruncate(todo.fd, pos);
+    todo.size = pos;
+    return 0;
+}
 
-    while (1)
-    {
-        struct command_t *command = malloc(sizeof(struct command_t));
-        memset(command, 0, sizeof(struct command_t)); // set all bytes to 0
+// Loads the todo list on first use. The first time, tasks of the old plain
+// text todo_list.txt are imported.
+static int todo_load() {
+    if (todo.loaded)
+        return 0;
 
-        int code;
-        code = prompt(command);
-        if (code == EXIT)
-            break;
+    const char *policy = getenv("SHELLFYRE_TODO_FSYNC");
+    todo.fsync_always = policy == NULL || strcmp(policy, "never") != 0;
 
-        code = process_command(command);
-        if (code == EXIT)
-            break;
+    char legacy[1024];
+    snprintf(legacy, sizeof(legacy), "%s", todo_file);
+    char *extension = strrchr(legacy, '.');
+    if (extension)
+        strcpy(extension, ".txt");
+    bool import = access(todo_file, F_OK) != 0 && strcmp(legacy, todo_file) != 0;
 
-        free_command(command);
+    if (todo_reload() != 0)
+        return -1;
+    todo.loaded = true;
+
+    FILE *fp = import ? fopen(legacy, "r") : NULL;
+    if (fp) {
+        char *line = NULL;
+        size_t size = 0;
+        ssize_t len;
+        while ((len = getline(&line, &size, fp)) > 0) {
+            if (line[len - 1] == '\n')
+                line[len - 1] = 0;
+            todo_append(line);
+        }
+        free(line);
+        fclose(fp);
     }
 
-    printf("\n");
     return 0;
 }
 
-int process_command(struct command_t *command)
-{
-    int r;
-    if (strcmp(command->name, "") == 0)
-        return SUCCESS;
+// Rewrites the log with the live tasks only. The live records are copied
+// under the lock, the new log is written and fsynced without it, so adding and
+// removing tasks go on meanwhile. Back under the lock, the records appended to
+// the old log in the meantime are copied over and the new log is renamed over
+// the old one, so a crash leaves either of them intact.
+static void *todo_compact(void *arg) {
+    pthread_mutex_lock(&todo.lock);
+    struct todo_record *snapshot = malloc(sizeof(struct todo_record) * (todo.count + 1));
+    int live = 0, slots = todo.slots, dead = todo.dead;
+    off_t old_size = todo.size;
+    for (int i = 0; i < slots; i++)
+        if (todo.records[i].live)
+            snapshot[live++] = todo.records[i];
+    pthread_mutex_unlock(&todo.lock);
 
-    if (strcmp(command->name, "exit") == 0) {
-        if (module_inserted) {
-            // Remove the kernel module, if it is inserted.
-            char *path = find_path("sudo");
-            char *args[] = {"sudo", "rmmod", "pstraverse.ko", NULL};
-            execv(path, args);
-        }
-        return EXIT;
+    char tmp_file[1100];
+    snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", todo_file);
+
+    // The log below old_size does not change, only the compactor rewrites it.
+    char *old_log = malloc(old_size + 1);
+    char *new_log = malloc(old_size + 1);
+    bool ok = pread(todo.fd, old_log, old_size, 0) == old_size;
+    off_t size = 0;
+
+    for (int i = 0; ok && i < live; i++) {
+        struct todo_record *r = &snapshot[i];
+        size += sprintf(new_log + size, "+%lu %zu\n", r->id, r->len);
+        memcpy(new_log + size, old_log + r->offset, r->len);
+        r->offset = size;
+        size += r->len;
+        new_log[size++] = '\n';
     }
 
-    if (strcmp(command->name, "cd") == 0)
-    {
-        if (command->arg_count > 0)
-        {
-            r = chdir(command->args[0]);
-            if (r == -1) {
-                printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+    int fd = ok ? open(tmp_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600) : -1;
+    ok = fd >= 0 && write(fd, new_log, size) == size && fsync(fd) == 0;
+
+    pthread_mutex_lock(&todo.lock);
+    off_t tail = todo.size - old_size;
+    if (ok && tail > 0) {
+        char *appended = malloc(tail);
+        ok = pread(todo.fd, appended, tail, old_size) == tail && write(fd, appended, tail) == tail
+             && fsync(fd) == 0;
+        free(appended);
+    }
+    if (fd >= 0)
+        close(fd);
+
+    if (ok && rename(tmp_file, todo_file) == 0) {
+        close(todo.fd);
+        todo.fd = open(todo_file, O_RDWR | O_APPEND | O_CLOEXEC);
+
+        // Records of the snapshot get their new offsets, the ones appended
+        // since move with the tail. Removed records leave the index.
+        int kept = 0;
+        for (int i = 0, j = 0; i < todo.slots; i++) {
+            struct todo_record r = todo.records[i];
+            if (!r.live)
+                continue;
+            if (i < slots) {
+                while (snapshot[j].id != r.id)
+                    j++;
+                r.offset = snapshot[j].offset;
             } else {
-                append_history_file();
+                r.offset += size - old_size;
             }
+            todo.records[kept++] = r;
+        }
+        todo.slots = kept;
+        todo.size = size + tail;
+        todo.dead -= dead;
+        todo_tree_build();
+    } else {
+        unlink(tmp_file);
+        ok = false;
+    }
+    todo.compacted = true;
+    pthread_mutex_unlock(&todo.lock);
 
-            return SUCCESS;
+    if (ok) {
+        // Make the rename itself durable.
+        char dir[1024];
+        snprintf(dir, sizeof(dir), "%s", todo_file);
+        char *slash = strrchr(dir, '/');
+        if (slash)
+            *slash = 0;
+        int dirfd = open(slash ? dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dirfd >= 0) {
+            fsync(dirfd);
+            close(dirfd);
         }
     }
 
-    // TODO: Implement your custom commands here
+    free(snapshot);
+    free(old_log);
+    free(new_log);
+    return NULL;
+}
 
-    // Filesearch command
-    if (strcmp(command->name, "filesearch") == 0) {
-        int size = 1024;
-        char *file_list[size];
-        for (int i = 0; i < size; i++) {
-            file_list[i] = (char *) calloc(128, 8);
-        }
+// Starts a compaction when more than half of the log is dead records. A
+// compaction that is still running is left alone. Called with the lock held.
+static void todo_maybe_compact() {
+    if (todo.dead < TODO_COMPACT_MIN_DEAD || todo.dead <= todo.count)
+        return;
 
-        if (command->arg_count == 1) {
-            search_file(command->args[0], ".", NULL, file_list);
-            print_files(file_list, size);
-        } else if (command->arg_count == 2) {
-            if (strcmp(command->args[1], "-r") == 0) {
-                search_file(command->args[0], ".", "r", file_list);
-                print_files(file_list, size);
-            } else if (strcmp(command->args[1], "-o") == 0) {
-                search_file(command->args[0], ".", NULL, file_list);
-                print_files(file_list, size);
-                open_files(file_list, size);
-            }
-        } else if (command->arg_count == 3) {
-            if ((strcmp(command->args[1], "-r") == 0 && strcmp(command->args[2], "-o") == 0) || (strcmp(command->args[1], "-o") == 0 && strcmp(command->args[2], "-r") == 0)) {
-                search_file(command->args[0], ".", "r", file_list);
-                print_files(file_list, size);
-                open_files(file_list, size);
-            }
-        } else {
-            printf("Missing arguments.\n");
-        }
+    if (todo.compacting) {
+        if (!todo.compacted)
+            return;
+        pthread_join(todo.compactor, NULL);
+    }
+    todo.compacted = false;
+    todo.compacting = pthread_create(&todo.compactor, NULL, todo_compact, NULL) == 0;
+}
 
-        for (int i = 0; i < 1024; i++) {
-            free(file_list[i]);
+// Waits for a running compaction, called before the shell exits.
+void todo_close() {
+    if (todo.compacting) {
+        pthread_join(todo.compactor, NULL);
+        todo.compacting = false;
+    }
+}
+
+// Adds a task to the end of the list.
+int todo_append(const char *text) {
+    if (todo_load() != 0)
+        return -1;
+
+    pthread_mutex_lock(&todo.lock);
+    size_t len = strlen(text);
+    char *record = malloc(len + 64);
+    int header_len = snprintf(record, 64, "+%lu %zu\n", todo.next_id, len);
+    memcpy(record + header_len, text, len);
+    record[header_len + len] = '\n';
+
+    off_t offset = todo.size + header_len;
+    int r = todo_write_record(record, header_len + len + 1);
+    if (r == 0)
+        todo_index_add(todo.next_id, offset, len);
+    free(record);
+    pthread_mutex_unlock(&todo.lock);
+    return r;
+}
+
+// Removes the task at the given 1-based position of the list.
+int todo_remove(int position) {
+    if (todo_load() != 0)
+        return -1;
+
+    pthread_mutex_lock(&todo.lock);
+    int r = -1;
+    if (position >= 1 && position <= todo.count) {
+        char record[32];
+        int slot = todo_tree_find(position);
+        int len = snprintf(record, sizeof(record), "-%lu\n", todo.records[slot].id);
+        r = todo_write_record(record, len);
+        if (r == 0)
+            todo_index_remove_slot(slot);
+    }
+    if (r == 0)
+        todo_maybe_compact();
+    pthread_mutex_unlock(&todo.lock);
+    return r;
+}
+
+// Lists the tasks of the todo list.
+void show_todo() {
+    if (todo_load() != 0 || todo.count == 0) {
+        printf("There is no task to do.\n");
+        return;
+    }
+
+    pthread_mutex_lock(&todo.lock);
+    char *text = NULL;
+    size_t size = 0;
+    int position = 1;
+    for (int i = 0; i < todo.slots; i++) {
+        struct todo_record *r = &todo.records[i];
+        if (!r->live)
+            continue;
+        if (r->len + 1 > size) {
+            size = r->len + 1;
+            text = realloc(text, size);
         }
+        if (pread(todo.fd, text, r->len, r->offset) != (ssize_t) r->len)
+            break;
+        text[r->len] = 0;
+        printf("%d) %s\n", position++, text);
+    }
+    free(text);
+    pthread_mutex_unlock(&todo.lock);
+}
 
-        return SUCCESS;
+// Add a new task to the todo list.
+void add_todo() {
+    char *task = NULL;
+    size_t size = 0;
+    printf("Task to add: ");
+    fflush(stdout);
+
+    ssize_t len = input_getline(&task, &size);
+    if (len > 0) {
+        if (task[len - 1] == '\n')
+            task[len - 1] = 0;
+        if (todo_append(task) != 0)
+            printf("-%s: todo: %s\n", sysname, strerror(errno));
     }
+    free(task);
+}
 
-    // cdh command
-    if (strcmp(command->name, "cdh") == 0) {
-        read_print_history();
-        append_history_file();
-        return SUCCESS;
+// Remove a task from the todo list.
+void remove_todo() {
+    if (todo_load() != 0 || todo.count == 0) {
+        printf("There is no task to remove.\n");
+        return;
     }
 
-    if (strcmp(command->name, "take") == 0) {
-        if (command->arg_count == 1) {
-            // Tokenize the string and create the directories, if they don't exist.
-            char *token = strtok(command->args[0], "/");
+    char *input = NULL;
+    size_t size = 0;
+    printf("Index of task to remove: ");
+    fflush(stdout);
+    if (input_getline(&input, &size) > 0 && todo_remove(atoi(input)) != 0)
+        printf("-%s: todo: no task with index %d\n", sysname, atoi(input));
+    free(input);
+}
 
-            while (token != NULL) {
-                mkdir(token, 0700);
-                chdir(token);
-                append_history_file();
-                token = strtok(NULL, "/");
-            }
+// One process of a /proc snapshot. The tree is kept in a flat array and
+// linked through indices, so building and walking it needs no allocation per node.
+struct proc_entry {
+    pid_t pid;
+    pid_t ppid;
+    uid_t uid;
+    char comm[16];
+    unsigned long long starttime;
+    unsigned long rss;              // in pages, for the subtree after aggregation
+    unsigned long long cputime;     // utime + stime in clock ticks
+    unsigned int threads;
+    unsigned int tasks;
+    pid_t *children;                // in the order of the kernel's children list, until linked
+    int child_count;
+    int parent;
+    int first_child;
+    int last_child;
+    int next_sibling;
+};
+
+// Shared state of the /proc scanner threads.
+struct proc_scan {
+    int procfd;
+    pid_t *pids;
+    int count;
+    int next;                       // next unclaimed index, taken atomically
+    struct proc_entry *entries;
+    bool *valid;
+};
+
+#define PROC_SCAN_THREADS 8
+#define PROC_SCAN_CHUNK 64
+
+// Reads the real user of a process, the first field of the Uid: line of
+// /proc/<pid>/status. The module filters on it, while the owner of the /proc
+// directory is the effective user, or root for a task that is not dumpable.
+static bool read_proc_uid(int procfd, pid_t pid, uid_t *uid) {
+    char path[32], buf[1024];
+    snprintf(path, sizeof(path), "%d/status", pid);
+
+    int fd = openat(procfd, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return false;
+    buf[n] = 0;
+
+    char *line = strstr(buf, "\nUid:");
+    return line && sscanf(line + 5, "%u", uid) == 1;
+}
+
+// Reads /proc/<pid>/stat relative to the /proc directory file descriptor.
+static bool read_proc_entry(int procfd, pid_t pid, struct proc_entry *entry) {
+    char path[32], buf[1024];
+    snprintf(path, sizeof(path), "%d/stat", pid);
+
+    int fd = openat(procfd, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return false;
+    buf[n] = 0;
+
+    // The name may contain spaces and parentheses, so it ends at the last ')'.
+    char *open = strchr(buf, '(');
+    char *close_paren = strrchr(buf, ')');
+    if (!open || !close_paren || close_paren < open)
+        return false;
+
+    size_t len = close_paren - open - 1;
+    if (len >= sizeof(entry->comm))
+        len = sizeof(entry->comm) - 1;
+    memcpy(entry->comm, open + 1, len);
+    entry->comm[len] = 0;
+
+    unsigned long long utime, stime;
+    if (sscanf(close_paren + 2, "%*c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %*d %*d %*d %*d %u %*d %llu %*u %lu",
+               &entry->ppid, &utime, &stime, &entry->threads, &entry->starttime, &entry->rss) != 6)
+        return false;
+
+    entry->pid = pid;
+    entry->cputime = utime + stime;
+    entry->tasks = 1;
+    return read_proc_uid(procfd, pid, &entry->uid);
+}
+
+// Reads /proc/<pid>/task/<pid>/children, the children of the main thread in
+// the order of its children list, which is the list the kernel module walks.
+// Orphans are added to the end of it when they are reparented, so the order
+// differs from the order of their start times.
+static void read_proc_children(int procfd, pid_t pid, struct proc_entry *entry) {
+    char path[48];
+    snprintf(path, sizeof(path), "%d/task/%d/children", pid, pid);
+
+    int fd = openat(procfd, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+
+    size_t size = 256, len = 0;
+    char *buf = malloc(size);
+    ssize_t n;
+    while ((n = read(fd, buf + len, size - len - 1)) > 0) {
+        len += n;
+        if (len + 1 == size)
+            buf = realloc(buf, size *= 2);
+    }
+    close(fd);
+    buf[len] = 0;
+
+    // Every pid is followed by a space.
+    int capacity = 0;
+    for (size_t i = 0; i < len; i++)
+        capacity += buf[i] == ' ';
+    if (capacity > 0) {
+        entry->children = malloc(sizeof(pid_t) * capacity);
+        char *next = buf, *end;
+        long child;
+        while (entry->child_count < capacity && (child = strtol(next, &end, 10)) > 0) {
+            entry->children[entry->child_count++] = child;
+            next = end;
         }
+    }
+    free(buf);
+}
 
-        return SUCCESS;
+// Scanner thread. Claims chunks of the PID list until all of them are read.
+static void *proc_scan_worker(void *arg) {
+    struct proc_scan *scan = arg;
+
+    while (1) {
+        int start = __atomic_fetch_add(&scan->next, PROC_SCAN_CHUNK, __ATOMIC_RELAXED);
+        if (start >= scan->count)
+            break;
+
+        int end = start + PROC_SCAN_CHUNK < scan->count ? start + PROC_SCAN_CHUNK : scan->count;
+        for (int i = start; i < end; i++) {
+            scan->valid[i] = read_proc_entry(scan->procfd, scan->pids[i], &scan->entries[i]);
+            if (scan->valid[i])
+                read_proc_children(scan->procfd, scan->pids[i], &scan->entries[i]);
+        }
     }
 
-    if (strcmp(command->name, "joker") == 0) {
-        // Create a temporary file for crontab then set the cron job.
-        FILE *fp = fopen("crontab_joker.txt", "w");
+    return NULL;
+}
+
+// Processes missing from the children files of their parents, the children of
+// other threads and the children of the idle task, are linked in fork order.
+static int compare_start(const void *a, const void *b) {
+    const struct proc_entry *x = a, *y = b;
+    if (x->starttime != y->starttime)
+        return x->starttime < y->starttime ? -1 : 1;
+    return (x->pid > y->pid) - (x->pid < y->pid);
+}
 
-        fputs("*/15 * * * * XDG_RUNTIME_DIR=/run/user/$(id -u) notify-send Joke \"$(curl -s https://icanhazdadjoke.com/)\"\n", fp);
-        fclose(fp);
+// Entries of the pid index are (pid, array index) pairs sorted by pid.
+static int compare_pid(const void *a, const void *b) {
+    const int *x = a, *y = b;
+    return (x[0] > y[0]) - (x[0] < y[0]);
+}
 
-        char *args[] = {"crontab", "crontab_joker.txt", NULL};
-        char *path = find_path("crontab");
+static int proc_index_find(int *index, int count, pid_t pid) {
+    int key[2] = {pid, 0};
+    int *found = bsearch(key, index, count, sizeof(int) * 2, compare_pid);
+    return found ? found[1] : -1;
+}
 
-        pid_t pid = fork();
-        if (pid == 0) {
-            execv(path, args);
-        } else {
-            wait(NULL);
+// Adds an entry to the end of the children of another.
+static void proc_link(struct proc_entry *entries, int parent, int child) {
+    entries[child].parent = parent;
+    if (entries[parent].last_child < 0)
+        entries[parent].first_child = child;
+    else
+        entries[entries[parent].last_child].next_sibling = child;
+    entries[parent].last_child = child;
+}
+
+// Scans /proc with a pool of threads and builds the process tree. Entry 0 is
+// the idle task (PID 0), the parent of init and kthreadd.
+static struct proc_entry *proc_snapshot(int *count) {
+    int procfd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (procfd < 0)
+        return NULL;
+
+    DIR *dir = fdopendir(dup(procfd));
+    if (!dir) {
+        close(procfd);
+        return NULL;
+    }
+
+    int capacity = 1024, n = 0;
+    pid_t *pids = malloc(sizeof(pid_t) * capacity);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (!isdigit(entry->d_name[0]))
+            continue;
+        if (n == capacity) {
+            capacity *= 2;
+            pids = realloc(pids, sizeof(pid_t) * capacity);
         }
+        pids[n++] = atoi(entry->d_name);
+    }
+    closedir(dir);
 
-        free(path);
-        remove("crontab_joker.txt");
+    struct proc_scan scan = {procfd, pids, n, 0, calloc(n + 1, sizeof(struct proc_entry)), calloc(n + 1, sizeof(bool))};
 
-        return SUCCESS;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus < 1 ? 1 : (cpus > PROC_SCAN_THREADS ? PROC_SCAN_THREADS : cpus);
+    if (threads > n / PROC_SCAN_CHUNK + 1)
+        threads = n / PROC_SCAN_CHUNK + 1;
+
+    pthread_t workers[PROC_SCAN_THREADS];
+    for (int i = 1; i < threads; i++)
+        pthread_create(&workers[i], NULL, proc_scan_worker, &scan);
+    proc_scan_worker(&scan);
+    for (int i = 1; i < threads; i++)
+        pthread_join(workers[i], NULL);
+    close(procfd);
+
+    // Compact the processes that could be read behind the idle task entry.
+    struct proc_entry *entries = malloc(sizeof(struct proc_entry) * (n + 1));
+    memset(&entries[0], 0, sizeof(struct proc_entry));
+    strcpy(entries[0].comm, "swapper/0");
+    entries[0].ppid = -1;
+    entries[0].tasks = 1;
+
+    int total = 1;
+    for (int i = 0; i < n; i++)
+        if (scan.valid[i])
+            entries[total++] = scan.entries[i];
+    free(scan.entries);
+    free(scan.valid);
+    free(pids);
+
+    qsort(entries + 1, total - 1, sizeof(struct proc_entry), compare_start);
+
+    int *index = malloc(sizeof(int) * 2 * total);
+    for (int i = 0; i < total; i++) {
+        index[2 * i] = entries[i].pid;
+        index[2 * i + 1] = i;
+        entries[i].parent = entries[i].first_child = entries[i].last_child = entries[i].next_sibling = -1;
+    }
+    qsort(index, total, sizeof(int) * 2, compare_pid);
+
+    // First the children in the order their parents list them, then the rest.
+    for (int i = 0; i < total; i++) {
+        for (int c = 0; c < entries[i].child_count; c++) {
+            int child = proc_index_find(index, total, entries[i].children[c]);
+            if (child > 0 && entries[child].parent < 0 && entries[child].ppid == entries[i].pid)
+                proc_link(entries, i, child);
+        }
+        free(entries[i].children);
+        entries[i].children = NULL;
+        entries[i].child_count = 0;
+    }
+    for (int i = 1; i < total; i++) {
+        int parent = proc_index_find(index, total, entries[i].ppid);
+        if (parent >= 0 && entries[i].parent < 0)
+            proc_link(entries, parent, i);
+    }
+    free(index);
+
+    *count = total;
+    return entries;
+}
+
+// Same filters as the kernel module.
+static bool proc_match(struct proc_entry *entry, const char *prefix, const char *match, long uid) {
+    if (uid >= 0 && entry->uid != uid)
+        return false;
+    if (prefix[0] && strncmp(entry->comm, prefix, strlen(prefix)) != 0)
+        return false;
+    if (match[0] && strstr(entry->comm, match) == NULL)
+        return false;
+    return true;
+}
+
+// Heaviest subtree (by RSS, then CPU time, then lowest PID) first, the order
+// of compare_nodes() in the module.
+static int compare_weight(const void *a, const void *b) {
+    const struct proc_entry *x = a, *y = b;
+    if (x->rss != y->rss)
+        return x->rss < y->rss ? 1 : -1;
+    if (x->cputime != y->cputime)
+        return x->cputime < y->cputime ? 1 : -1;
+    return (x->pid > y->pid) - (x->pid < y->pid);
+}
+
+// Unprivileged pstraverse backend. Produces the same records as the kernel
+// module from a /proc snapshot. Mode is 'd' (DFS), 'b' (BFS) or 'a' (aggregation).
+int pstraverse_proc(pid_t root, char mode, int max_depth, const char *prefix, const char *match, long uid, int max_records) {
+    int count;
+    struct proc_entry *entries = proc_snapshot(&count);
+    if (!entries)
+        return -1;
+
+    int start = -1;
+    for (int i = 0; i < count; i++) {
+        if (entries[i].pid == root) {
+            start = i;
+            break;
+        }
     }
+    if (start < 0) {
+        printf("PID does not exist.\n");
+        free(entries);
+        return 0;
+    }
+
+    int matched = 0;
+    int *queue = malloc(sizeof(int) * 2 * count);
+
+    if (mode == 'd') {
+        // Walk down through first children and back up through parents, so
+        // deep trees need no stack.
+        int node = start, depth = 0;
+        while (node >= 0 && (max_records == 0 || matched < max_records)) {
+            struct proc_entry *e = &entries[node];
+            if (proc_match(e, prefix, match, uid)) {
+                printf("Name: %s PID: %d\n", e->comm, e->pid);
+                matched++;
+            }
 
-    // My own command -> Author: Kemal Bora Bayraktar
-    // This command shows the todo list.
-    if (strcmp(command->name, "todo") == 0) {
-        if (command->arg_count == 0) {
-            show_todo();
-        } else if (command->arg_count == 1) {
-            if (strcmp(command->args[0], "add") == 0) {
-                add_todo();
-            } else if (strcmp(command->args[0], "remove") == 0) {
-                remove_todo();
+            if (e->first_child >= 0 && (max_depth < 0 || depth < max_depth)) {
+                node = e->first_child;
+                depth++;
+                continue;
+            }
+            while (node != start && entries[node].next_sibling < 0) {
+                node = entries[node].parent;
+                depth--;
+            }
+            node = node == start ? -1 : entries[node].next_sibling;
+        }
+    } else if (mode == 'b') {
+        int head = 0, tail = 0;
+        queue[tail++] = start;
+        queue[tail++] = 0;
+        while (head < tail && (max_records == 0 || matched < max_records)) {
+            struct proc_entry *e = &entries[queue[head]];
+            int depth = queue[head + 1];
+            head += 2;
+
+            if (proc_match(e, prefix, match, uid)) {
+                printf("Name: %s PID: %d\n", e->comm, e->pid);
+                matched++;
+            }
+
+            if (max_depth >= 0 && depth >= max_depth)
+                continue;
+            for (int child = e->first_child; child >= 0; child = entries[child].next_sibling) {
+                queue[tail++] = child;
+                queue[tail++] = depth + 1;
+            }
+        }
+    } else if (mode == 'a') {
+        // Collect the subtree in pre-order, then fold every node into its parent
+        // walking backwards, which visits children before parents.
+        int n = 0, node = start;
+        while (node >= 0) {
+            queue[n++] = node;
+            if (entries[node].first_child >= 0) {
+                node = entries[node].first_child;
+                continue;
             }
+            while (node != start && entries[node].next_sibling < 0)
+                node = entries[node].parent;
+            node = node == start ? -1 : entries[node].next_sibling;
+        }
+        for (int i = n - 1; i > 0; i--) {
+            struct proc_entry *child = &entries[queue[i]], *parent = &entries[child->parent];
+            parent->rss += child->rss;
+            parent->cputime += child->cputime;
+            parent->threads += child->threads;
+            parent->tasks += child->tasks;
         }
 
-        return SUCCESS;
-    }
-
-    if (strcmp(command->name, "pstraverse") == 0) {
-        pstraverse(command);
+        struct proc_entry *subtree = malloc(sizeof(struct proc_entry) * n);
+        for (int i = 0; i < n; i++)
+            subtree[i] = entries[queue[i]];
+        qsort(subtree, n, sizeof(struct proc_entry), compare_weight);
 
-        return SUCCESS;
+        long page_kb = sysconf(_SC_PAGESIZE) / 1024;
+        long ticks = sysconf(_SC_CLK_TCK);
+        int top = max_records ? max_records : 10;
+        for (int i = 0; i < n && matched < top; i++) {
+            struct proc_entry *e = &subtree[i];
+            if (!proc_match(e, prefix, match, uid))
+                continue;
+            printf("Name: %s PID: %d RSS: %lu kB CPU: %llu ms Threads: %u Tasks: %u\n",
+                   e->comm, e->pid, e->rss * page_kb, e->cputime * 1000 / ticks, e->threads, e->tasks);
+            matched++;
+        }
+        free(subtree);
     }
 
-    pid_t pid = fork();
-
-    if (pid == 0) // child
-    {
-        // increase args size by 2
-        command->args = (char **)realloc(
-                command->args, sizeof(char *) * (command->arg_count += 2));
+    free(queue);
+    free(entries);
+    return 0;
+}
 
-        // shift everything forward by 1
-        for (int i = command->arg_count - 2; i > 0; --i)
-            command->args[i] = command->args[i - 1];
+// Run pstraverse with the given PID, option and filters, then print the records
+// returned by the kernel module. The module is used when it is loaded, or when
+// the shell runs as root and can insert it; otherwise the records are built
+// from /proc by pstraverse_proc(). "-backend proc|module" forces either one.
+// With -a the heaviest subtrees (RSS, CPU time, threads) are printed and
+// -max selects how many of them are shown. "pstraverse cache on|off" switches the
+// module to answer from a process tree kept up to date by fork/exit tracepoints.
+// Usage: pstraverse <pid> <-d|-b|-a> [-depth N] [-prefix name] [-match name] [-uid N] [-max N] [-backend proc|module]
+void pstraverse(struct command_t *command, struct flags *flags) {
+    static const char *modes[] = {[PSTRAVERSE_DFS] = "-d", [PSTRAVERSE_BFS] = "-b", [PSTRAVERSE_AGGREGATE] = "-a"};
+    unsigned int mode_flags = flags->set & ((1u << PSTRAVERSE_DFS) | (1u << PSTRAVERSE_BFS) | (1u << PSTRAVERSE_AGGREGATE));
+    bool cache_request = flags->positional_count == 2 && strcmp(flags->positional[0], "cache") == 0;
 
-        // set args[0] as a copy of name
-        command->args[0] = strdup(command->name);
-        // set args[arg_count-1] (last) to NULL
-        command->args[command->arg_count - 1] = NULL;
+    if (!cache_request && (flags->positional_count != 1 || mode_flags == 0 || (mode_flags & (mode_flags - 1)) != 0)) {
+        printf("Usage: pstraverse <pid> <-d|-b|-a> [-depth N] [-prefix name] [-match name] [-uid N] [-max N] [-backend proc|module]\n");
+        printf("       pstraverse cache <on|off>\n");
+        return;
+    }
 
-        /// TODO: do your own exec with path resolving using execv()
+    const char *mode = modes[__builtin_ctz(mode_flags ? mode_flags : 1)];
+    const char *backend = flags->values[PSTRAVERSE_BACKEND];
+    const char *prefix = flags->values[PSTRAVERSE_PREFIX] ? flags->values[PSTRAVERSE_PREFIX] : "";
+    const char *match = flags->values[PSTRAVERSE_MATCH] ? flags->values[PSTRAVERSE_MATCH] : "";
+    int max_depth = flags->values[PSTRAVERSE_DEPTH] ? atoi(flags->values[PSTRAVERSE_DEPTH]) : -1;
+    int max_records = flags->values[PSTRAVERSE_MAX] ? atoi(flags->values[PSTRAVERSE_MAX]) : 0;
+    long uid = flags->values[PSTRAVERSE_UID] ? atol(flags->values[PSTRAVERSE_UID]) : -1;
 
-        // Find the path of the command, then execute.
-        char *path = find_path(command->name);
-        if (path != NULL) {
-            execv(path, command->args);
-        } else {
-            printf("-%s: %s: command not found\n", sysname, command->name);
+    // Translate the options into the "key=value" filters understood by the module.
+    char request[256];
+    int len;
+    if (cache_request) {
+        len = snprintf(request, sizeof(request), "cache %s", flags->positional[1]);
+    } else {
+        len = snprintf(request, sizeof(request), "%s %s", flags->positional[0], mode);
+        for (int f = PSTRAVERSE_DEPTH; f <= PSTRAVERSE_MAX && len < sizeof(request); f++) {
+            if (flags->values[f])
+                len += snprintf(request + len, sizeof(request) - len, " %s=%s", pstraverse_flags[f].name + 1, flags->values[f]);
         }
+    }
+    if (len >= sizeof(request)) {
+        printf("-%s: pstraverse: arguments are too long\n", sysname);
+        return;
+    }
+
+    bool use_module = access("/dev/my_device", W_OK) == 0
+        || (!module_inserted && geteuid() == 0 && access("pstraverse.ko", R_OK) == 0);
+    if (backend != NULL)
+        use_module = strcmp(backend, "module") == 0;
 
-        exit(0);
+    if (!use_module) {
+        if (cache_request) {
+            printf("-%s: pstraverse: the cache needs the kernel module\n", sysname);
+        } else if (pstraverse_proc(atoi(flags->positional[0]), mode[1], max_depth, prefix, match, uid, max_records) != 0) {
+            printf("-%s: pstraverse: /proc: %s\n", sysname, strerror(errno));
+        }
+        return;
     }
-    else
-    {
-        /// TODO: Wait for child to finish if command is not running in background
 
-        if (!command->background) {
+    if (!module_inserted && access("/dev/my_device", W_OK) != 0) {
+        pid_t current_pid = fork();
+        if (current_pid == 0) {
+            char *path = find_path("sudo");
+            char *args[] = {"sudo", "insmod", "pstraverse.ko", NULL};
+            execv(path, args);
+            exit(1);
+        } else {
+            module_inserted = 1;
             wait(NULL);
         }
+    }
 
-        return SUCCESS;
+    int fp = open("/dev/my_device", O_RDWR);
+    if (fp < 0) {
+        printf("-%s: pstraverse: /dev/my_device: %s\n", sysname, strerror(errno));
+        return;
     }
 
-    printf("-%s: %s: command not found\n", sysname, command->name);
-    return UNKNOWN;
+    if (write(fp, request, strlen(request) + 1) < 0) {
+        printf("-%s: pstraverse: %s\n", sysname, strerror(errno));
+    } else if (!cache_request) {
+        // Only the records that passed the filters are copied out of the module.
+        char buf[4096];
+        ssize_t n;
+        fflush(stdout);
+        while ((n = read(fp, buf, sizeof(buf))) > 0) {
+            write(STDOUT_FILENO, buf, n);
+        }
+    }
+    close(fp);
 }
 
-// Function to find the path of a command.
-char* find_path(char *command_name) {
 
-    char PATH[1024];
-    strcpy(PATH, getenv("PATH"));
+// Server mode, `shellfyre --serve <socket>`. Clients connect to a UNIX stream
+// socket and send command lines as frames of a type byte, a 32-bit big endian
+// length and the payload:
+//   C <line>     client: run a command line
+//   O <data>     server: standard output of the command
+//   E <data>     server: standard error of the command
+//   X <status>   server: the command is done, 32-bit big endian exit status
+// Every client has its own working directory, which `cd` and `take` change, and
+// its commands run one after the other. A command runs in a forked job process
+// through parse_command() and process_command(), like a line typed at the
+// prompt. At most serve.max_jobs jobs run at once, the other clients wait in a
+// FIFO. The output of a job is not read while its client has too much unsent
+// output, and a client is not read while it has too many commands buffered,
+// so a slow client only slows down itself.
+#define SERVE_MAX_FRAME 65536
+#define SERVE_OUT_LIMIT (256 * 1024)
+#define SERVE_IN_LIMIT (64 * 1024)
+#define SERVE_MAX_CLIENTS 1024
 
-    char *token = strtok(PATH, ":");
-    struct stat *file_properties = malloc(sizeof(struct stat));
+enum serve_fd_kinds
+{
+    SERVE_LISTEN = 1,
+    SERVE_CLIENT,
+    SERVE_STDOUT,
+    SERVE_STDERR,
+    SERVE_REPORT, // working directory of the job at its end
+    SERVE_EXIT,   // pidfd of the job
+};
 
-    char *command_path = malloc(512);
-    while (token != NULL) {
-        strcpy(command_path, "");
+struct serve_client;
 
-        strcat(command_path, token);
-        strcat(command_path, "/");
-        strcat(command_path, command_name);
+struct serve_job
+{
+    pid_t pid;
+    int fds[4]; // stdout, stderr, report, pidfd
+    char report[PATH_MAX + 2];
+    size_t report_len;
+    bool paused;
+    bool eof[3]; // a pipe at its end reports EPOLLHUP whatever is watched, so it is not watched
+};
 
-        int exists = stat(command_path, file_properties);
+struct serve_client
+{
+    int fd;
+    char cwd[PATH_MAX];
+    char *in;
+    size_t in_len;
+    char *out;
+    size_t out_len, out_sent, out_capacity;
+    struct serve_job *job;
+    struct serve_client *next_waiting;
+    struct serve_client *next_check;
+    bool waiting, checked;
+    bool reading, writing;
+    bool eof;     // the client sends no more commands
+    bool closing; // close when the output is sent
+    bool hangup;  // the client is gone
+};
 
-        if ((exists == 0) && (file_properties->st_mode & S_IXUSR)) {
-            free(file_properties);
-            return command_path;
-        }
+// What a file descriptor returned by epoll belongs to.
+struct serve_fd
+{
+    int kind;
+    struct serve_client *client;
+};
 
-        token = strtok(NULL, ":");
-    }
+struct serve
+{
+    int epoll_fd;
+    int listen_fd;
+    bool accepting;
+    struct serve_fd *fds;
+    int fd_capacity;
+    int clients;
+    int jobs, max_jobs;
+    struct serve_client *first_waiting, *last_waiting;
+    struct serve_client *check; // clients that may be done, freed after the events
+    int *closed;                // unwatched descriptors, closed after the events
+    int closed_count, closed_capacity;
+};
 
-    free(command_path);
-    free(file_properties);
-    return NULL;
-}
+static struct serve serve;
 
-// This function finds the files that contains a certain string in a given directory.
-void search_file(char *file, char *dir_name, char *option, char *file_list[]) {
-    DIR *dir;
-    struct dirent *entry;
+static void serve_watch(int fd, int kind, struct serve_client *client, unsigned int events)
+{
+    if (fd >= serve.fd_capacity)
+    {
+        int capacity = fd * 2 + 64;
+        serve.fds = realloc(serve.fds, sizeof(struct serve_fd) * capacity);
+        memset(serve.fds + serve.fd_capacity, 0, sizeof(struct serve_fd) * (capacity - serve.fd_capacity));
+        serve.fd_capacity = capacity;
+    }
+    serve.fds[fd].kind = kind;
+    serve.fds[fd].client = client;
 
-    dir = opendir(dir_name);
+    struct epoll_event event = {.events = events, .data.fd = fd};
+    epoll_ctl(serve.epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
 
-    if (dir) {
-        while ((entry = readdir(dir)) != NULL) {
-            if (strstr(entry->d_name, file) && entry->d_type == DT_REG) {
-                int index = 0;
-                while (strcmp(file_list[index], "") != 0) {
-                    index++;
-                }
+static void serve_modify(int fd, unsigned int events)
+{
+    struct epoll_event event = {.events = events, .data.fd = fd};
+    epoll_ctl(serve.epoll_fd, EPOLL_CTL_MOD, fd, &event);
+}
 
-                int size = 1024;
-                char *temp = (char *) malloc(size);
-                snprintf(temp, size, "%s/%s", dir_name, entry->d_name);
+// Stops watching a pipe of a job at its end, it is closed with the others.
+static void serve_eof(struct serve_job *job, int index)
+{
+    epoll_ctl(serve.epoll_fd, EPOLL_CTL_DEL, job->fds[index], NULL);
+    job->eof[index] = true;
+}
 
-                file_list[index] = temp;
-            }
+// Stops watching a descriptor. It is closed after the events of the current
+// epoll_wait() are handled, so an event still pending for it cannot be taken
+// for an event of a new descriptor with the same number.
+static void serve_unwatch(int fd)
+{
+    epoll_ctl(serve.epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    serve.fds[fd].kind = 0;
+    if (serve.closed_count == serve.closed_capacity)
+    {
+        serve.closed_capacity = serve.closed_capacity ? serve.closed_capacity * 2 : 64;
+        serve.closed = realloc(serve.closed, sizeof(int) * serve.closed_capacity);
+    }
+    serve.closed[serve.closed_count++] = fd;
+}
 
-            if (option != NULL && strcmp(option, "r") == 0) {
-                if (entry->d_type == DT_DIR) {
-                    char path[1024];
+// Returns true if the client has a whole frame buffered.
+static bool serve_has_frame(struct serve_client *client)
+{
+    uint32_t size;
+    if (client->in_len < 5)
+        return false;
+    memcpy(&size, client->in + 1, 4);
+    return client->in_len >= 5 + ntohl(size);
+}
 
-                    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-                        continue;
+// Applies the flow control of a client to what epoll watches, after any change
+// of its buffers or state.
+static void serve_update(struct serve_client *client)
+{
+    bool reading = !client->eof && !client->closing && !client->hangup && client->in_len < SERVE_IN_LIMIT;
+    bool writing = !client->hangup && client->out_sent < client->out_len;
+    if (client->hangup && serve.fds[client->fd].kind == SERVE_CLIENT)
+    {
+        // A closed socket reports EPOLLHUP whatever is watched. The descriptor
+        // stays open until the client is freed, so its number is not reused.
+        epoll_ctl(serve.epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+        serve.fds[client->fd].kind = 0;
+    }
+    else if (!client->hangup && (reading != client->reading || writing != client->writing))
+    {
+        client->reading = reading;
+        client->writing = writing;
+        serve_modify(client->fd, (reading ? EPOLLIN : 0) | (writing ? EPOLLOUT : 0));
+    }
 
-                    snprintf(path, sizeof(path), "%s/%s", dir_name, entry->d_name);
-                    search_file(file, path, "r", file_list);
-                }
-            }
+    struct serve_job *job = client->job;
+    bool paused = !client->hangup && client->out_len - client->out_sent > SERVE_OUT_LIMIT;
+    if (job && paused != job->paused)
+    {
+        job->paused = paused;
+        for (int i = 0; i < 2; i++)
+            if (!job->eof[i])
+                serve_modify(job->fds[i], paused ? 0 : EPOLLIN);
+    }
 
-        }
-        closedir(dir);
+    if (!client->checked)
+    {
+        client->checked = true;
+        client->next_check = serve.check;
+        serve.check = client;
     }
 }
 
-// Prints the files that have been found.
-void print_files(char *file_list[], size_t size) {
-    for (int i = 0; i < size; i++) {
-        if (strcmp(file_list[i], "") == 0) {
-            int index = i - 1;
-
-            while (index >= 0) {
-                printf("\t%s\n", file_list[index]);
-                index--;
-            }
-
+static void serve_flush(struct serve_client *client)
+{
+    while (!client->hangup && client->out_sent < client->out_len)
+    {
+        ssize_t n = send(client->fd, client->out + client->out_sent, client->out_len - client->out_sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
             break;
-        }
+        if (n <= 0)
+            client->hangup = true;
+        else
+            client->out_sent += n;
     }
+    if (client->hangup || client->out_sent == client->out_len)
+        client->out_sent = client->out_len = 0;
+    serve_update(client);
 }
 
-// Open the files with the users deafult application.
-void open_files(char *file_list[], size_t size) {
-    for (int i = 0; i < size; i++) {
-        if (strcmp(file_list[i], "") != 0) {
-            char *args[] = {"xdg-open", file_list[i], NULL};
-
-            pid_t pid = fork();
-            if (pid == 0) {
-                char *path = find_path("xdg-open");
-                execv(path, args);
-                free(path);
-            } else {
-                wait(NULL);
-            }
-        }
+// Queues a frame for the client and tries to send it right away.
+static void serve_send(struct serve_client *client, char type, const void *data, size_t len)
+{
+    if (client->hangup)
+        return;
+    if (client->out_len + 5 + len > client->out_capacity)
+    {
+        client->out_capacity = (client->out_len + 5 + len) * 2;
+        client->out = realloc(client->out, client->out_capacity);
     }
+    char *frame = client->out + client->out_len;
+    uint32_t size = htonl(len);
+    frame[0] = type;
+    memcpy(frame + 1, &size, 4);
+    memcpy(frame + 5, data, len);
+    client->out_len += 5 + len;
+    serve_flush(client);
 }
 
-// Append the changed directory to cdh_history.txt file.
-void append_history_file() {
-    FILE *fp = fopen(cdh_file, "a+");
+// Frees the clients that are done: gone, or told to close or out of commands,
+// with nothing left to send.
+static void serve_reap()
+{
+    while (serve.check)
+    {
+        struct serve_client *client = serve.check;
+        serve.check = client->next_check;
+        client->checked = false;
 
-    if (fp) {
-        char line[1024];
-        char cwd[800];
+        bool idle = !client->job && !client->waiting;
+        bool finished = client->closing || (client->eof && !serve_has_frame(client));
+        if (!idle || !(client->hangup || (finished && client->out_len == 0)))
+            continue;
 
-        getcwd(cwd, sizeof(cwd));
-        snprintf(line, sizeof(line), "%s\n", cwd);
-        fputs(line, fp);
+        serve_unwatch(client->fd);
+        free(client->in);
+        free(client->out);
+        free(client);
+        serve.clients--;
     }
-
-    fclose(fp);
 }
 
-// Reads and prints cdh_history.txt, then waits for an input from the
-// user and changes to that directory.
-void read_print_history() {
-    FILE *fp = fopen(cdh_file, "r");
-    if (!fp) {
-        printf("You didn't visited any directory yet.\n");
-    } else {
-        char lines[100][1024];
-
-        int number_of_lines = 0;
-        while (fgets(lines[number_of_lines], 1024, fp)) number_of_lines++;
-
-        char last_ten_dir[10][1024];
-        int counter = 0;
-        int number_of_dir = 0;
-        while (number_of_lines >= 0 && counter <= 10) {
-            strcpy(last_ten_dir[number_of_dir], lines[number_of_lines]);
-            number_of_lines--;
-            number_of_dir++;
-            counter++;
-        }
+// Runs in the job process: the command line in the client's working
+// directory, then the directory it ended in to the report pipe.
+static void serve_run(const char *cwd, char *line, int report_fd)
+{
+    signal(SIGPIPE, SIG_DFL);
+    if (chdir(cwd) != 0)
+    {
+        printf("-%s: %s: %s\n", sysname, cwd, strerror(errno));
+        exit(1);
+    }
 
-        int i = 0;
-        while (i < number_of_dir - 1) {
-            char output[1024];
-            strcpy(output, last_ten_dir[number_of_dir - i - 1]);
-            char *loc = strstr(output, getenv("HOME"));
+    struct command_t *command = calloc(1, sizeof(struct command_t));
+    parse_command(line, command);
+    int code = process_command(command);
+    fflush(stdout);
 
-            if (loc) {
-                int n = 0;
-                while (loc[n] == getenv("HOME")[n]) n++;
-                printf("%c %d) ~%s", 95 + number_of_dir - i, number_of_dir - i - 1, loc + n);
-            } else {
-                printf("%c %d) %s", 95 + number_of_dir - i, number_of_dir - i - 1, output);
-            }
+    char report[PATH_MAX + 2];
+    report[0] = code == EXIT ? 'x' : '.';
+    if (getcwd(report + 1, sizeof(report) - 1) == NULL)
+        strcpy(report + 1, cwd);
+    write(report_fd, report, strlen(report));
+    exit(last_status);
+}
 
-            i++;
-        }
+// Starts the first command line of a client in a job process.
+static void serve_start(struct serve_client *client)
+{
+    uint32_t size;
+    memcpy(&size, client->in + 1, 4);
+    size = ntohl(size);
+    char *line = strndup(client->in + 5, size);
+    client->in_len -= 5 + size;
+    memmove(client->in, client->in + 5 + size, client->in_len);
 
-        char input[10];
-        printf("Select directory by letter or number: ");
-        fgets(input, 10, stdin);
-        input[strlen(input) - 1] = '\0';
+    struct serve_job *job = calloc(1, sizeof(struct serve_job));
+    // Pipes not created are -1, and the error is kept for the client.
+    int pipes[3][2] = {{-1, -1}, {-1, -1}, {-1, -1}};
+    int error = 0;
+    for (int i = 0; i < 3 && error == 0; i++)
+        if (pipe2(pipes[i], O_CLOEXEC) != 0)
+            error = errno;
 
-        int valid = 1;
-        for (int i = 0; i < strlen(input); i++) {
-            if (!isdigit(input[i])) {
-                valid = 0;
-            }
-        }
+    fflush(stdout);
+    job->pid = error == 0 ? fork() : -1;
+    if (job->pid < 0 && error == 0)
+        error = errno;
+    if (job->pid == 0)
+    {
+        int fd = open("/dev/null", O_RDONLY);
+        dup2(fd, STDIN_FILENO);
+        dup2(pipes[0][1], STDOUT_FILENO);
+        dup2(pipes[1][1], STDERR_FILENO);
+        dup2(pipes[2][1], 3);
+        close_range(4, ~0U, 0);
+        serve_run(client->cwd, line, 3);
+    }
+    free(line);
 
-        if (valid && atoi(input) < number_of_dir) {
-            char *path = last_ten_dir[atoi(input)];
-            path[strlen(path) - 1] = '\0';
-            chdir(path);
-        } else if (strlen(input) == 1 && input[0] > 96 && input[0] < 97 + number_of_dir - 1) {
-            char *path = last_ten_dir[input[0] - 96];
-            path[strlen(path) - 1] = '\0';
-            chdir(path);
-        }
+    for (int i = 0; i < 3; i++)
+    {
+        if (pipes[i][1] >= 0)
+            close(pipes[i][1]);
+        job->fds[i] = pipes[i][0];
+        if (job->fds[i] >= 0)
+            fcntl(job->fds[i], F_SETFL, O_NONBLOCK);
+    }
+    job->fds[3] = job->pid > 0 ? pidfd_open(job->pid, 0) : -1;
+    if (job->fds[3] < 0)
+    {
+        const char *message = strerror(error ? error : errno);
+        uint32_t status = htonl(126);
+        for (int i = 0; i < 3; i++)
+            if (job->fds[i] >= 0)
+                close(job->fds[i]);
+        if (job->pid > 0)
+            waitpid(job->pid, NULL, 0);
+        free(job);
+        serve_send(client, 'E', message, strlen(message));
+        serve_send(client, 'X', &status, 4);
+        return;
     }
+
+    client->job = job;
+    serve.jobs++;
+    serve_watch(job->fds[0], SERVE_STDOUT, client, EPOLLIN);
+    serve_watch(job->fds[1], SERVE_STDERR, client, EPOLLIN);
+    serve_watch(job->fds[2], SERVE_REPORT, client, EPOLLIN);
+    serve_watch(job->fds[3], SERVE_EXIT, client, EPOLLIN);
+    serve_update(client);
 }
 
-// Lists the tasks from the todo_list.txt file.
-void show_todo() {
-    FILE *fp = fopen(todo_file, "r");
+// Puts the client in the FIFO if it has a command and none running.
+static void serve_enqueue(struct serve_client *client)
+{
+    if (client->closing || client->hangup || client->job || client->waiting || !serve_has_frame(client))
+        return;
+    client->waiting = true;
+    client->next_waiting = NULL;
+    if (serve.last_waiting)
+        serve.last_waiting->next_waiting = client;
+    else
+        serve.first_waiting = client;
+    serve.last_waiting = client;
+}
 
-    if (!fp) {
-        printf("There is no task to do.\n");
-    } else {
-        char line[200];
+// Checks the frame at the head of the input of a client and queues the client
+// if it is a whole command. A bad frame ends the session. While a command runs
+// the frames behind it wait, they are checked when it is done.
+static void serve_parse(struct serve_client *client)
+{
+    uint32_t size;
+    memcpy(&size, client->in + 1, 4);
+    if (client->job)
+        return;
+    if (client->in_len >= 5 && (client->in[0] != 'C' || ntohl(size) > SERVE_MAX_FRAME))
+    {
+        const char *error = "-shellfyre: bad frame";
+        client->in_len = 0;
+        client->closing = true;
+        serve_send(client, 'E', error, strlen(error));
+    }
+    serve_enqueue(client);
+}
 
-        int i = 1;
-        while (fgets(line, sizeof(line), fp)) {
-            printf("%d) %s", i, line);
-            i++;
-        }
+// Starts jobs of waiting clients while there are free slots.
+static void serve_schedule()
+{
+    while (serve.jobs < serve.max_jobs && serve.first_waiting)
+    {
+        struct serve_client *client = serve.first_waiting;
+        serve.first_waiting = client->next_waiting;
+        if (serve.first_waiting == NULL)
+            serve.last_waiting = NULL;
+        client->waiting = false;
 
-        if (i == 1) {
-            printf("There is no task to do.\n");
+        if (client->hangup)
+            serve_update(client);
+        else
+        {
+            serve_start(client);
+            serve_parse(client); // only queued if the job could not start
         }
-        fclose(fp);
     }
 }
 
-// Add a new task to todo_list.txt.
-void add_todo() {
-    FILE *fp = fopen(todo_file, "a+");
-
-    if (fp) {
-        char task[1024];
-        printf("Task to add: ");
-        fgets(task, sizeof(task), stdin);
-
-        fputs(task, fp);
+static void serve_read_client(struct serve_client *client)
+{
+    size_t capacity = SERVE_IN_LIMIT + 5 + SERVE_MAX_FRAME;
+    while (client->in_len < capacity)
+    {
+        ssize_t n = recv(client->fd, client->in + client->in_len, capacity - client->in_len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            break;
+        if (n == 0)
+            client->eof = true;
+        else if (n < 0)
+            client->hangup = true;
+        if (n <= 0)
+            break;
+        client->in_len += n;
     }
 
-    fclose(fp);
+    serve_parse(client);
+    serve_update(client);
 }
 
-// Remove a task from todo_list.txt file.
-void remove_todo() {
-    FILE *fp = fopen(todo_file, "r");
-    FILE *temp = fopen("temp.txt", "w");
+// Moves the output of a job to its client. Returns false at the end of the
+// output.
+static bool serve_read_output(struct serve_client *client, int fd, char type)
+{
+    char buf[16384];
+    ssize_t n;
+    while (!client->job->paused && (n = read(fd, buf, sizeof(buf))) > 0)
+        serve_send(client, type, buf, n);
+    return client->job->paused || (n < 0 && (errno == EAGAIN || errno == EINTR));
+}
 
-    char line[200];
+// The job process exited: the rest of its output and its status go to the
+// client, which continues with its next command.
+static void serve_finish(struct serve_client *client)
+{
+    struct serve_job *job = client->job;
+    int status = 0;
+    waitpid(job->pid, &status, 0);
 
-    if (!fp) {
-        printf("There is no task to remove.\n");
-    } else {
-        char input[10];
-        printf("Index of task to remove: ");
-        fgets(input, sizeof(input), stdin);
-        int line_number = atoi(input);
+    job->paused = false; // at most a pipe buffer is left
+    serve_read_output(client, job->fds[0], 'O');
+    serve_read_output(client, job->fds[1], 'E');
+    ssize_t n;
+    while ((n = read(job->fds[2], job->report + job->report_len, sizeof(job->report) - 1 - job->report_len)) > 0)
+        job->report_len += n;
+    job->report[job->report_len] = 0;
+    for (int i = 0; i < 4; i++)
+        serve_unwatch(job->fds[i]); // the pipes at their end are only closed
 
-        int i = 1;
-        while(fgets(line, sizeof(line), fp)) {
-            if (i != line_number) {
-                fputs(line, temp);
-            }
-            i++;
-        }
-        fclose(temp);
-        fclose(fp);
+    if (job->report_len > 1)
+        snprintf(client->cwd, sizeof(client->cwd), "%s", job->report + 1);
+    if (job->report[0] == 'x') // the exit builtin ends the session
+    {
+        client->closing = true;
+        client->in_len = 0;
+    }
+    client->job = NULL;
+    free(job);
+    serve.jobs--;
 
-        fp = fopen(todo_file, "w");
-        temp = fopen("temp.txt", "r");
-        while(fgets(line, sizeof(line), temp)) {
-            fputs(line, fp);
-        }
-        fclose(temp);
-        fclose(fp);
-        remove("temp.txt");
+    uint32_t code = htonl(WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+    serve_send(client, 'X', &code, 4);
+    serve_parse(client); // the commands sent behind this one
+    serve_update(client);
+}
+
+static void serve_accept()
+{
+    while (serve.clients < SERVE_MAX_CLIENTS)
+    {
+        int fd = accept4(serve.listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+            break;
+
+        struct serve_client *client = calloc(1, sizeof(struct serve_client));
+        client->fd = fd;
+        client->in = malloc(SERVE_IN_LIMIT + 5 + SERVE_MAX_FRAME);
+        client->reading = true;
+        getcwd(client->cwd, sizeof(client->cwd));
+        serve_watch(fd, SERVE_CLIENT, client, EPOLLIN);
+        serve.clients++;
     }
 }
 
-// Run pstraverse with the given PID and option.
-// If the kernel module is not inserted, insert it.
-void pstraverse(struct command_t *command) {
-    char pid[10];
-    char option[10];
+/**
+ * Runs the command lines of the clients of a UNIX socket until killed
+ * @param  socket_path path of the socket, replaced if it exists
+ * @return             1 if the socket could not be set up
+ */
+int serve_main(const char *socket_path)
+{
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(address.sun_path))
+    {
+        printf("-%s: %s: %s\n", sysname, socket_path, strerror(ENAMETOOLONG));
+        return 1;
+    }
+    strcpy(address.sun_path, socket_path);
 
-    snprintf(pid, sizeof(pid), "pid=%s", command->args[0]);
-    snprintf(option, sizeof(option), "option=%s", command->args[1]);
+    serve.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    unlink(socket_path);
+    if (bind(serve.listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(serve.listen_fd, 128) != 0)
+    {
+        printf("-%s: %s: %s\n", sysname, socket_path, strerror(errno));
+        return 1;
+    }
 
-    if (!module_inserted) {
-        pid_t current_pid = fork();
-        if (current_pid == 0) {
-            char *path = find_path("sudo");
-            char *args[] = {"sudo", "insmod", "pstraverse.ko", pid, option, NULL};
-            execv(path, args);
-        } else {
-            module_inserted = 1;
-            wait(NULL);
+    const char *jobs = getenv("SHELLFYRE_SERVE_JOBS");
+    serve.max_jobs = jobs && atoi(jobs) > 0 ? atoi(jobs) : 2 * sysconf(_SC_NPROCESSORS_ONLN);
+    signal(SIGPIPE, SIG_IGN);
+    serve.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    serve_watch(serve.listen_fd, SERVE_LISTEN, NULL, EPOLLIN);
+    serve.accepting = true;
+
+    struct epoll_event events[64];
+    while (1)
+    {
+        int count = epoll_wait(serve.epoll_fd, events, 64, -1);
+        for (int i = 0; i < count; i++)
+        {
+            int fd = events[i].data.fd;
+            struct serve_client *client = serve.fds[fd].client;
+
+            switch (serve.fds[fd].kind)
+            {
+            case SERVE_LISTEN:
+                serve_accept();
+                break;
+            case SERVE_CLIENT:
+                if (events[i].events & (EPOLLHUP | EPOLLERR))
+                    client->hangup = true;
+                if (events[i].events & EPOLLOUT)
+                    serve_flush(client);
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                    serve_read_client(client);
+                break;
+            case SERVE_STDOUT:
+            case SERVE_STDERR:
+                if (!serve_read_output(client, fd, serve.fds[fd].kind == SERVE_STDOUT ? 'O' : 'E'))
+                    serve_eof(client->job, serve.fds[fd].kind == SERVE_STDOUT ? 0 : 1);
+                break;
+            case SERVE_REPORT:
+            {
+                struct serve_job *job = client->job;
+                ssize_t n = read(fd, job->report + job->report_len, sizeof(job->report) - 1 - job->report_len);
+                if (n > 0)
+                    job->report_len += n;
+                else
+                    serve_eof(job, 2);
+                break;
+            }
+            case SERVE_EXIT:
+                serve_finish(client);
+                break;
+            }
         }
-    } else {
-        int fp = open("/dev/my_device", O_RDWR);
 
-        if (fp >= 0) {
-            int8_t write_buf[20];
-            strcpy(write_buf, command->args[0]);
-            strcat(write_buf, " ");
-            strcat(write_buf, command->args[1]);
-            write(fp, write_buf, strlen(write_buf) + 1);
+        serve_schedule();
+        serve_reap();
+        while (serve.closed_count > 0)
+            close(serve.closed[--serve.closed_count]);
+
+        // Accept only while there is room for more clients.
+        bool accepting = serve.clients < SERVE_MAX_CLIENTS;
+        if (accepting != serve.accepting)
+        {
+            serve.accepting = accepting;
+            serve_modify(serve.listen_fd, accepting ? EPOLLIN : 0);
         }
-        close(fp);
     }
 }
-